@@ -5,17 +5,25 @@
 //  Created by Dave Hayden on 9/25/24.
 //
 
+#include <math.h>
+#include <stdatomic.h>
+
 #include "SDL.h"
 #include "assert.h"
 
 #include "audio.h"
 #include "ringbuffer.h"
+#include "resample.h"
+#include "avsync.h"
+#include "pacing.h"
 
 #define LOG printf
 //#define LOG(s)
 
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
 #define AUDIO_SAMPLE_RATE 44100
-#define BUFFER_SIZE 32768
+#define BUFFER_SIZE 65536 // 370 ms of stereo: the largest target plus the largest a/v delay, and room for a packet
 unsigned int silentcount = BUFFER_SIZE;
 
 static RingBuffer buffer;
@@ -24,35 +32,301 @@ SDL_AudioDeviceID soundDevice;
 const int SDL_FRAME_SIZE = sizeof(int16_t) * 2;
 unsigned int num_channels = 2;
 
+static Resampler resampler;
+
+// The ring is a jitter buffer: playback waits until it holds the target
+// amount, and again after running dry. Running dry is an underrun if more
+// audio shows up soon after; if not, the device just stopped sending. Each
+// underrun raises the target a step; after a while without one it creeps
+// back to what was asked for.
+#define DEFAULT_TARGET_MS 40
+#define MIN_TARGET_MS 5
+#define MAX_TARGET_MS 150
+#define UNDERRUN_STEP_MS 5
+#define UNDERRUN_GAP_MS 200 // silence longer than this after running dry is a pause, not an underrun
+#define TARGET_DECAY_QUIET_SEC 30 // seconds without an underrun before lowering it again, 1 ms a second,
+#define TARGET_DECAY_HEADROOM_MS 5 // as long as the fill never got closer than this to empty
+
+static unsigned int requestedTarget_ms = DEFAULT_TARGET_MS;
+static _Atomic unsigned int target_ms = DEFAULT_TARGET_MS;
+static bool priming = true;
+static bool ranDry = false;
+static unsigned int dryFill; // what the resampler couldn't use when it ran dry
+static unsigned int dryFrames; // played since
+static bool liveStats = false;
+static unsigned int printedTarget_ms = DEFAULT_TARGET_MS;
+
+// fill over the last second, in frames: the least left right after a
+// callback (how close it came to running dry), mean and max as callbacks found it
+static unsigned int windowMin, windowMax, windowCount;
+static double windowTotal;
+static unsigned int windowFrames;
+static unsigned int quietSeconds = 0;
+
+// The audio clock: frames received (including any dropped) run on the
+// device's clock from anchor_us, the device time of the first one, which is
+// taken from the frame timestamps. The callback knows how many it has played.
+static _Atomic int64_t anchor_us = INT64_MIN;
+static uint64_t receivedFrames = 0; // stream thread
+static _Atomic uint64_t droppedFrames = 0;
+static uint64_t consumedFrames = 0; // callback
+static unsigned int deviceBufferFrames = 0;
+static double audioLatency = 0;
+
+// a/v sync: extra frames held in the ring so the sound waits for the picture,
+// and silence still to play before the ring's next frame
+static unsigned int syncDelayFrames = 0;
+static unsigned int padFrames = 0;
+
+#define MAX_SYNC_DELAY_MS 150
+#define LATENCY_SMOOTHING (1.0 / 16) // callbacks are bursty, the picture shouldn't follow every one
+
+// The callback fills windows[(windowSeq + 1) & 1] and then bumps windowSeq,
+// so a reader copying windows[windowSeq & 1] is only overwritten if it takes
+// a whole second; it checks windowSeq again afterwards and retries if so.
+static AudioStats windows[2];
+static _Atomic unsigned int windowSeq = 0;
+
+// The device's clock and ours drift apart, so the ring slowly fills or
+// drains. The callback watches the average fill and plays a hair faster or
+// slower to hold it near the target, at exactly 1x (a plain copy) while it's
+// within the deadband.
+#define FILL_SMOOTHING (1.0 / 64) // per callback, about a second and a half
+#define DRIFT_START 0.10 // fraction of the target the fill can wander before correcting
+#define DRIFT_STOP 0.05 // and how close it has to come back before stopping
+#define DRIFT_GAIN 0.01 // speed change per target's worth of error
+#define MAX_DRIFT 0.002 // 0.2%, a couple of cents of pitch at most
+
+static double fillAverage = -1;
+static double playbackRatio = 1.0;
+
+static unsigned int underruns = 0;
+static _Atomic unsigned int overflows = 0; // stream thread, read by the callback
+static double maxDrift = 0;
+static double fillTotal = 0;
+static unsigned int fillCount = 0;
+
+static inline unsigned int targetFrames()
+{
+	return AUDIO_SAMPLE_RATE * atomic_load_explicit(&target_ms, memory_order_relaxed) / 1000 + syncDelayFrames;
+}
+
+static void adjustRate(unsigned int fill)
+{
+	double target = targetFrames();
+
+	if ( fillAverage < 0 )
+		fillAverage = fill;
+	else
+		fillAverage += (fill - fillAverage) * FILL_SMOOTHING;
+
+	fillTotal += fill;
+	++fillCount;
+
+	double error = (fillAverage - target) / target;
+	double ratio = playbackRatio;
+
+	if ( fabs(error) > DRIFT_START || (ratio != 1.0 && fabs(error) > DRIFT_STOP) )
+		ratio = 1.0 + fmax(-MAX_DRIFT, fmin(MAX_DRIFT, error * DRIFT_GAIN));
+	else
+		ratio = 1.0;
+
+	if ( ratio != playbackRatio )
+	{
+		resample_setRatio(&resampler, ratio);
+		playbackRatio = ratio;
+
+		if ( fabs(ratio - 1.0) > maxDrift )
+			maxDrift = fabs(ratio - 1.0);
+	}
+}
+
+static void underrun()
+{
+	unsigned int t = atomic_load_explicit(&target_ms, memory_order_relaxed);
+
+	++underruns;
+	quietSeconds = 0;
+
+	if ( t + UNDERRUN_STEP_MS <= MAX_TARGET_MS )
+		atomic_store_explicit(&target_ms, t + UNDERRUN_STEP_MS, memory_order_relaxed);
+}
+
+static void trackFill(unsigned int fill, unsigned int left, unsigned int frames)
+{
+	if ( windowCount == 0 || left < windowMin )
+		windowMin = left;
+
+	if ( windowCount == 0 || fill > windowMax )
+		windowMax = fill;
+
+	windowTotal += fill;
+	++windowCount;
+	windowFrames += frames;
+
+	if ( windowFrames < AUDIO_SAMPLE_RATE )
+		return;
+
+	unsigned int t = atomic_load_explicit(&target_ms, memory_order_relaxed);
+
+	if ( ++quietSeconds >= TARGET_DECAY_QUIET_SEC && t > requestedTarget_ms && windowMin > AUDIO_SAMPLE_RATE * TARGET_DECAY_HEADROOM_MS / 1000 )
+		atomic_store_explicit(&target_ms, t - 1, memory_order_relaxed);
+
+	unsigned int seq = atomic_load_explicit(&windowSeq, memory_order_relaxed);
+	AudioStats* w = &windows[(seq + 1) & 1];
+
+	w->target_ms = t;
+	w->min_ms = windowMin * 1000.0f / AUDIO_SAMPLE_RATE;
+	w->max_ms = windowMax * 1000.0f / AUDIO_SAMPLE_RATE;
+	w->mean_ms = (float)(windowTotal / windowCount * 1000 / AUDIO_SAMPLE_RATE);
+	w->speed_ppm = (float)((playbackRatio - 1.0) * 1e6);
+	w->underruns = underruns;
+	w->overflows = atomic_load_explicit(&overflows, memory_order_relaxed);
+	atomic_store_explicit(&windowSeq, seq + 1, memory_order_release);
+
+	windowCount = 0;
+	windowTotal = 0;
+	windowFrames = 0;
+}
+
+// picture wants the sound later (positive) or sooner, in frames
+static void shiftAudio(int64_t frames, unsigned int fill)
+{
+	if ( frames > 0 )
+	{
+		if ( frames > (int64_t)(AUDIO_SAMPLE_RATE * MAX_SYNC_DELAY_MS / 1000 - syncDelayFrames) )
+			frames = AUDIO_SAMPLE_RATE * MAX_SYNC_DELAY_MS / 1000 - syncDelayFrames;
+
+		// silence now, and the ring holds that much more from here on
+		padFrames += (unsigned int)frames;
+		syncDelayFrames += (unsigned int)frames;
+	}
+	else
+	{
+		unsigned int trim = (unsigned int)-frames;
+
+		trim = MIN(trim, syncDelayFrames);
+		trim = MIN(trim, fill);
+
+		RingBuffer_moveOutputPointer(&buffer, trim * sizeof(int16_t) * num_channels);
+		consumedFrames += trim;
+		syncDelayFrames -= trim;
+	}
+}
+
+// when the frame at the read pointer will be heard, against its device time
+static void updateClock()
+{
+	int64_t anchor = atomic_load_explicit(&anchor_us, memory_order_acquire);
+
+	if ( anchor == INT64_MIN )
+		return;
+
+	uint64_t played = consumedFrames + atomic_load_explicit(&droppedFrames, memory_order_relaxed);
+	int64_t deviceTime = anchor + (int64_t)(played * 1000000 / AUDIO_SAMPLE_RATE);
+	int64_t heard = (int64_t)pacing_now() + (int64_t)((uint64_t)(deviceBufferFrames + padFrames) * 1000000 / AUDIO_SAMPLE_RATE);
+	double latency = (double)(heard - deviceTime);
+
+	if ( audioLatency == 0 )
+		audioLatency = latency;
+	else
+		audioLatency += (latency - audioLatency) * LATENCY_SMOOTHING;
+
+	avsync_setAudioLatency((int64_t)audioLatency, (int64_t)((uint64_t)syncDelayFrames * 1000000 / AUDIO_SAMPLE_RATE));
+}
+
 void SDLAudioCallback(void* userdata, Uint8* stream, int len)
 {
+	int16_t* stream16 = (int16_t*)stream;
+	unsigned int frames = (unsigned)(len / SDL_FRAME_SIZE);
+	unsigned int frameBytes = sizeof(int16_t) * num_channels;
+	unsigned int fill = RingBuffer_getBytesAvailable(&buffer) / frameBytes;
+	unsigned int i = 0;
+
 	if ( silentcount >= BUFFER_SIZE / (sizeof(int16_t) * num_channels) )
 	{
+		// nothing but zeros in there, but they still count for the clock
+		unsigned int n = MIN(fill, frames);
+		RingBuffer_moveOutputPointer(&buffer, n * frameBytes);
+		consumedFrames += n;
 		memset(stream, 0, (unsigned)len);
+		updateClock();
 		return;
 	}
-	
-	if ( num_channels == 1 )
+
+	if ( priming )
 	{
-		int16_t* stream16 = (int16_t*)stream;
-		int16_t s;
+		if ( ranDry && fill > dryFill )
+		{
+			ranDry = false;
+
+			if ( dryFrames < AUDIO_SAMPLE_RATE * UNDERRUN_GAP_MS / 1000 )
+				underrun();
+		}
+		else if ( ranDry )
+			dryFrames += frames;
 
-		for ( int i = 0; i < len / SDL_FRAME_SIZE; ++i )
+		if ( fill < targetFrames() )
 		{
-			if ( RingBuffer_readData(&buffer, &s, 2) != 2 )
-				break;
-			
-			stream16[2*i] = stream16[2*i+1] = s;
+			memset(stream, 0, (unsigned)len);
+			return;
 		}
+
+		priming = false;
+		fillAverage = -1;
 	}
-	else
-		RingBuffer_readData(&buffer, stream, (unsigned)len);
+
+	int64_t shift_us = avsync_takeAudioShift();
+
+	if ( shift_us != 0 )
+	{
+		shiftAudio(shift_us * AUDIO_SAMPLE_RATE / 1000000, fill);
+		fill = RingBuffer_getBytesAvailable(&buffer) / frameBytes;
+	}
+
+	updateClock();
+
+	if ( padFrames > 0 )
+	{
+		i = MIN(padFrames, frames);
+		memset(stream16, 0, i * (unsigned)SDL_FRAME_SIZE);
+		padFrames -= i;
+	}
+
+	adjustRate(fill);
+
+	// with the mirrored buffer this is one pass, otherwise two at most
+	while ( i < frames )
+	{
+		unsigned int used;
+		unsigned int n = resample_run(&resampler, RingBuffer_getOutputPointer(&buffer), RingBuffer_getOutputAvailableSize(&buffer) / frameBytes, &used, stream16 + 2 * i, frames - i);
+
+		RingBuffer_moveOutputPointer(&buffer, used * frameBytes);
+		consumedFrames += used;
+		i += n;
+
+		if ( n == 0 )
+			break;
+	}
+
+	// ran dry: silence, not whatever SDL left in the stream last time
+	if ( i < frames )
+	{
+		memset(stream16 + 2 * i, 0, (frames - i) * (unsigned)SDL_FRAME_SIZE);
+		priming = true;
+		ranDry = true;
+		dryFill = RingBuffer_getBytesAvailable(&buffer) / frameBytes;
+		dryFrames = 0;
+	}
+
+	trackFill(fill, RingBuffer_getBytesAvailable(&buffer) / frameBytes, frames);
 }
 
 bool audio_init()
 {
 	RingBuffer_init(&buffer);
-	RingBuffer_setSize(&buffer, BUFFER_SIZE, SDL_FRAME_SIZE);
+	RingBuffer_setSizeMirrored(&buffer, BUFFER_SIZE, SDL_FRAME_SIZE);
+	resample_init(&resampler, num_channels);
 
 	if ( SDL_InitSubSystem(SDL_INIT_AUDIO) != 0 )
 	{
@@ -75,7 +349,12 @@ bool audio_init()
 	want.freq = AUDIO_SAMPLE_RATE;
 	want.format = AUDIO_S16LSB;
 	want.channels = 2;
-	want.samples = 256 * SDL_FRAME_SIZE;
+	// a device buffer of at most half the target, so one callback can't eat the whole cushion
+	want.samples = 1024;
+
+	while ( want.samples > 128 && want.samples * 2000 > AUDIO_SAMPLE_RATE * requestedTarget_ms )
+		want.samples /= 2;
+
 	want.callback = SDLAudioCallback;
 
 	soundDevice = SDL_OpenAudioDevice
@@ -87,29 +366,113 @@ bool audio_init()
 		0); // do not SDL_AUDIO_ALLOW_FORMAT_CHANGE
 
 	LOG("soundDevice: %d\n", soundDevice);
+	LOG("audio buffer target %u ms, device buffer %u frames\n", requestedTarget_ms, have.samples);
+	deviceBufferFrames = have.samples;
 	
 	return true;
 }
 
+void audio_setLatency(unsigned int ms)
+{
+	requestedTarget_ms = ms < MIN_TARGET_MS ? MIN_TARGET_MS : ms > MAX_TARGET_MS ? MAX_TARGET_MS : ms;
+	printedTarget_ms = requestedTarget_ms;
+	atomic_store(&target_ms, requestedTarget_ms);
+}
+
+void audio_setLiveStats(bool enable)
+{
+	liveStats = enable;
+}
+
+bool audio_getStats(AudioStats* stats)
+{
+	static unsigned int seen = 0;
+	unsigned int seq;
+
+	do
+	{
+		seq = atomic_load_explicit(&windowSeq, memory_order_acquire);
+
+		if ( seq == 0 )
+			return false;
+
+		*stats = windows[seq & 1];
+		atomic_thread_fence(memory_order_acquire);
+	}
+	while ( atomic_load_explicit(&windowSeq, memory_order_relaxed) != seq );
+
+	bool fresh = seq != seen;
+	seen = seq;
+	return fresh;
+}
+
+// on the stream thread, where printing doesn't hold up the device
+static void printStats()
+{
+	AudioStats st;
+
+	if ( !audio_getStats(&st) )
+		return;
+
+	if ( liveStats )
+	{
+		AVSyncStats av;
+		avsync_getStats(&av);
+
+		printf("audio: fill %.1f / %.1f / %.1f ms min/mean/max, target %u ms, speed %+.0f ppm, %u underruns, a/v offset %+.1f ms\n",
+			   st.min_ms, st.mean_ms, st.max_ms, st.target_ms, st.speed_ppm, st.underruns, av.offset_us / 1000.0);
+	}
+	else if ( st.target_ms > printedTarget_ms )
+		printf("audio underrun, buffer target now %u ms\n", st.target_ms);
+
+	printedTarget_ms = st.target_ms;
+}
+
 void audio_setFormat(unsigned int channels)
 {
+	if ( channels == num_channels )
+		return;
+
+	SDL_LockAudioDevice(soundDevice);
 	num_channels = channels;
+	resampler.channels = channels;
+	SDL_UnlockAudioDevice(soundDevice);
 }
 
 static bool running = false;
 
-void audio_addData(uint8_t* data, unsigned int len)
+// len bytes arrived, added of them made it into the ring
+static void received(unsigned int len, unsigned int added)
+{
+	unsigned int frameBytes = sizeof(int16_t) * num_channels;
+	uint64_t device;
+
+	// pinned to the frame it came after, sound for a frame follows the frame
+	if ( atomic_load_explicit(&anchor_us, memory_order_relaxed) == INT64_MIN && avsync_getVideoTime(&device) )
+		atomic_store_explicit(&anchor_us, (int64_t)device - (int64_t)(receivedFrames * 1000000 / AUDIO_SAMPLE_RATE), memory_order_release);
+
+	receivedFrames += len / frameBytes;
+
+	if ( added < len )
+		atomic_fetch_add_explicit(&droppedFrames, (len - added) / frameBytes, memory_order_relaxed);
+}
+
+void audio_addData(const uint8_t* data, unsigned int len)
 {
 	unsigned int avail = RingBuffer_getFreeSpace(&buffer);
+	unsigned int sent = len;
 	
 	if ( avail < len )
 	{
 		printf("audio buffer overflowed\n");
 		len = avail;
+		atomic_fetch_add_explicit(&overflows, 1, memory_order_relaxed);
 	}
 	
 	RingBuffer_addData(&buffer, data, len);
+	received(sent, len);
 	silentcount = 0;
+	printStats();
 	
 	if ( !running )
 	{
@@ -122,25 +485,51 @@ void audio_stop()
 {
 	SDL_PauseAudioDevice(soundDevice, 1);
 	RingBuffer_reset(&buffer);
+	resample_init(&resampler, num_channels);
+	fillAverage = -1;
+	playbackRatio = 1.0;
+	priming = true;
+	ranDry = false;
 	running = false;
+
+	avsync_clearAudio();
+	atomic_store(&anchor_us, INT64_MIN);
+	atomic_store(&droppedFrames, 0);
+	receivedFrames = 0;
+	consumedFrames = 0;
+	audioLatency = 0;
+	syncDelayFrames = 0;
+	padFrames = 0;
 }
 
-#define MIN(a,b) (((a)<(b))?(a):(b))
+void audio_report()
+{
+	printf("audio: buffer avg %.1f ms (target %u, asked for %u), speed max %.0f ppm off, %u underruns, %u overflows\n",
+		   fillCount > 0 ? fillTotal / fillCount * 1000 / AUDIO_SAMPLE_RATE : 0, atomic_load(&target_ms), requestedTarget_ms, maxDrift * 1e6, underruns, atomic_load(&overflows));
+}
 
 void audio_addSilence(unsigned int len)
 {
+	unsigned int added = 0;
+
 	if ( silentcount < BUFFER_SIZE / num_channels )
 	{
 		silentcount += len;
 		
-		while ( len > 0 )
+		for ( unsigned int left = len; left > 0; )
 		{
 			static const int16_t zeros[] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
-			unsigned int l = MIN(len, sizeof(zeros));
-			RingBuffer_addData(&buffer, zeros, l);
-			len -= l;
+			unsigned int l = MIN(left, sizeof(zeros));
+			added += RingBuffer_addData(&buffer, zeros, l);
+			left -= l;
 		}
 	}
 	else // buffer is all zero, can just push ringbuffer pointer forward
-		RingBuffer_moveInputPointer(&buffer, len);
+	{
+		added = MIN(len, RingBuffer_getFreeSpace(&buffer));
+		RingBuffer_moveInputPointer(&buffer, added);
+	}
+
+	// a gap in the sound is still time passing on the device
+	received(len, added);
 }
@@ -12,12 +12,35 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+typedef struct
+{
+	unsigned int target_ms; // where the jitter buffer is aiming now
+	float min_ms; // over the last second, the least left after a callback
+	float mean_ms; // and the fill callbacks found
+	float max_ms;
+	float speed_ppm; // drift correction
+	unsigned int underruns; // since start
+	unsigned int overflows;
+} AudioStats;
+
+// how much audio to hold back against stream jitter, before audio_init()
+void audio_setLatency(unsigned int ms);
+
+// prints the fill stats every second
+void audio_setLiveStats(bool enable);
+
 bool audio_init();
 void audio_setFormat(unsigned int channels);
 
 void audio_stop();
 
-void audio_addData(uint8_t* data, unsigned int len);
+void audio_addData(const uint8_t* data, unsigned int len);
 void audio_addSilence(unsigned int len);
 
+// the last second's numbers, returns true if they're new since the last call
+bool audio_getStats(AudioStats* stats);
+
+// playback speed correction and buffer health so far
+void audio_report();
+
 #endif /* audio_h */
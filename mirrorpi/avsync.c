@@ -0,0 +1,153 @@
+//
+//  avsync.c
+//  MirrorJr
+//
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "avsync.h"
+
+#define FRAME_US 33333 // at 30 fps; "in sync" is within this
+#define SHIFT_THRESHOLD_US (FRAME_US / 2) // smoothed offset that gets the audio moved
+#define SETTLE_FRAMES 30 // frames to measure after a shift before judging again
+#define OFFSET_SMOOTHING 8 // frames, for the smoothed offset
+
+// UINT64_MAX/INT64_MIN for unknown
+static _Atomic uint64_t videoTime = UINT64_MAX;
+static _Atomic int64_t audioLatency = INT64_MIN;
+static _Atomic int64_t audioDelay = 0;
+static _Atomic int64_t pendingShift = 0;
+
+// renderer side, and the stats, under statsLock
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+static AVSyncStats stats;
+static bool haveOffset = false;
+static unsigned int settling = SETTLE_FRAMES;
+
+void avsync_reset()
+{
+	atomic_store(&videoTime, UINT64_MAX);
+
+	pthread_mutex_lock(&statsLock);
+	stats = (AVSyncStats){ 0 };
+	haveOffset = false;
+	settling = SETTLE_FRAMES;
+	pthread_mutex_unlock(&statsLock);
+}
+
+void avsync_setVideoTime(uint64_t deviceTime_us)
+{
+	atomic_store_explicit(&videoTime, deviceTime_us, memory_order_relaxed);
+}
+
+bool avsync_getVideoTime(uint64_t* deviceTime_us)
+{
+	*deviceTime_us = atomic_load_explicit(&videoTime, memory_order_relaxed);
+	return *deviceTime_us != UINT64_MAX;
+}
+
+void avsync_setAudioLatency(int64_t latency_us, int64_t delay_us)
+{
+	atomic_store_explicit(&audioDelay, delay_us, memory_order_relaxed);
+	atomic_store_explicit(&audioLatency, latency_us, memory_order_relaxed);
+}
+
+void avsync_clearAudio()
+{
+	atomic_store(&audioLatency, INT64_MIN);
+	atomic_store(&audioDelay, 0);
+	atomic_store(&pendingShift, 0);
+}
+
+int64_t avsync_takeAudioShift()
+{
+	return atomic_exchange_explicit(&pendingShift, 0, memory_order_relaxed);
+}
+
+static bool getLatency(int64_t* latency_us, int64_t* delay_us)
+{
+	*delay_us = atomic_load_explicit(&audioDelay, memory_order_relaxed);
+	*latency_us = atomic_load_explicit(&audioLatency, memory_order_relaxed);
+	return *latency_us != INT64_MIN;
+}
+
+bool avsync_getAudioLatency(int64_t* latency_us)
+{
+	int64_t delay;
+
+	if ( !getLatency(latency_us, &delay) )
+		return false;
+
+	*latency_us -= delay;
+	return true;
+}
+
+void avsync_presented(uint64_t deviceTime_us, uint64_t now_us)
+{
+	int64_t audio, delay;
+
+	if ( !getLatency(&audio, &delay) )
+		return;
+
+	int64_t offset = (int64_t)(now_us - deviceTime_us) - audio;
+	uint64_t size = (uint64_t)(offset < 0 ? -offset : offset);
+
+	pthread_mutex_lock(&statsLock);
+
+	++stats.frames;
+	stats.totalOffset_us += offset;
+	stats.audioDelay_us = delay;
+
+	if ( size <= FRAME_US )
+		++stats.inSync;
+
+	if ( size > stats.maxOffset_us )
+		stats.maxOffset_us = size;
+
+	if ( !haveOffset )
+		stats.offset_us = offset;
+	else
+		stats.offset_us += (offset - stats.offset_us) / OFFSET_SMOOTHING;
+
+	haveOffset = true;
+
+	// Pacing already aims frames at the audio latency, so a steady offset means
+	// frames got here too late for it (or were held back by the pacing limit):
+	// make the audio wait for them, or give back a wait that isn't needed now.
+	if ( settling > 0 )
+		--settling;
+	else if ( stats.offset_us > SHIFT_THRESHOLD_US || stats.offset_us < -SHIFT_THRESHOLD_US )
+	{
+		atomic_fetch_add_explicit(&pendingShift, stats.offset_us, memory_order_relaxed);
+		++stats.shifts;
+		settling = SETTLE_FRAMES;
+		haveOffset = false;
+	}
+
+	pthread_mutex_unlock(&statsLock);
+}
+
+void avsync_getStats(AVSyncStats* out)
+{
+	pthread_mutex_lock(&statsLock);
+	*out = stats;
+	pthread_mutex_unlock(&statsLock);
+}
+
+void avsync_report()
+{
+	AVSyncStats s;
+	avsync_getStats(&s);
+
+	if ( s.frames == 0 )
+	{
+		printf("a/v sync: no frames shown with audio playing\n");
+		return;
+	}
+
+	printf("a/v sync: %u frames, offset avg %+.1f max %.1f ms, %.0f%% within a frame, %u audio shifts, audio delayed %.1f ms\n",
+		   s.frames, s.totalOffset_us / 1000.0 / s.frames, s.maxOffset_us / 1000.0, 100.0 * s.inSync / s.frames,
+		   s.shifts, s.audioDelay_us / 1000.0);
+}
@@ -0,0 +1,56 @@
+//
+//  avsync.h
+//  MirrorJr
+//
+//  Keeps picture and sound together. Frame timestamps and the count of audio
+//  samples received both run on the device's clock; the audio callback says
+//  when the sample it's reading will be heard, which gives the audio latency
+//  (local play time minus device time). Pacing shows frames at that same
+//  latency, and what's left over after presenting -- frames that couldn't be
+//  shown that soon -- is made up by delaying the audio.
+//
+
+#ifndef avsync_h
+#define avsync_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct
+{
+	unsigned int frames; // presented while audio was playing
+	unsigned int inSync; // within a frame of the audio
+	int64_t totalOffset_us; // video - audio: positive is picture behind sound
+	uint64_t maxOffset_us; // largest |offset|
+	int64_t offset_us; // smoothed, right now
+	int64_t audioDelay_us; // added to the audio to wait for the picture
+	unsigned int shifts; // times the audio was asked to move to match
+} AVSyncStats;
+
+// new session, forget both clocks
+void avsync_reset();
+
+// stream thread: device time of the latest frame, what the first audio gets pinned to
+void avsync_setVideoTime(uint64_t deviceTime_us);
+bool avsync_getVideoTime(uint64_t* deviceTime_us);
+
+// audio callback: local play time minus device time of what it's playing,
+// delay_us of which was added by avsync_takeAudioShift(). Cleared when the
+// audio stops. Pacing gets the latency without the added delay, so the
+// picture doesn't chase a delay that's there to wait for it.
+void avsync_setAudioLatency(int64_t latency_us, int64_t delay_us);
+void avsync_clearAudio();
+bool avsync_getAudioLatency(int64_t* latency_us);
+
+// audio callback: how much later (or, negative, sooner) the audio should
+// play to match the picture, since the last call. Sooner only gives back
+// earlier delays; audio can't play before it arrives.
+int64_t avsync_takeAudioShift();
+
+// renderer: a frame with this device time went on screen at now_us
+void avsync_presented(uint64_t deviceTime_us, uint64_t now_us);
+
+void avsync_getStats(AVSyncStats* stats);
+void avsync_report();
+
+#endif /* avsync_h */
@@ -0,0 +1,128 @@
+//
+//  bands.c
+//  MirrorJr
+//
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "bands.h"
+
+#define MAX_BANDS 8
+
+// below this many rows a band costs more in wakeups than it saves
+#define MIN_BAND_ROWS 16
+
+static unsigned int numBands = 1;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t finished = PTHREAD_COND_INITIALIZER;
+
+// the current job, workers pick it up when generation changes
+static unsigned int generation = 0;
+static unsigned int busy = 0;
+static BandFunc jobFunc;
+static void* jobData;
+static unsigned int jobEdges[MAX_BANDS + 1];
+static unsigned int jobBands;
+
+static void* workerMain(void* ud)
+{
+	unsigned int band = (unsigned int)(uintptr_t)ud;
+	unsigned int seen = 0;
+
+	pthread_mutex_lock(&lock);
+
+	for ( ;; )
+	{
+		while ( generation == seen )
+			pthread_cond_wait(&start, &lock);
+
+		seen = generation;
+
+		if ( band >= jobBands )
+			continue;
+
+		pthread_mutex_unlock(&lock);
+		jobFunc(jobData, jobEdges[band], jobEdges[band + 1]);
+		pthread_mutex_lock(&lock);
+
+		if ( --busy == 0 )
+			pthread_cond_signal(&finished);
+	}
+
+	return NULL;
+}
+
+bool bands_init(unsigned int count)
+{
+	if ( count > MAX_BANDS )
+		count = MAX_BANDS;
+
+	// band 0 is the caller's
+	for ( unsigned int i = numBands; i < count; ++i )
+	{
+		pthread_t thread;
+
+		if ( pthread_create(&thread, NULL, workerMain, (void*)(uintptr_t)i) != 0 )
+		{
+			printf("couldn't start band worker %u\n", i);
+			return false;
+		}
+
+		pthread_detach(thread);
+		numBands = i + 1;
+	}
+
+	return true;
+}
+
+unsigned int bands_count()
+{
+	return numBands;
+}
+
+void bands_run(BandFunc fn, void* ud, unsigned int first, unsigned int end, unsigned int align)
+{
+	unsigned int units = (end - first + align - 1) / align;
+	unsigned int count = (end - first) / MIN_BAND_ROWS;
+
+	if ( count > numBands )
+		count = numBands;
+
+	if ( count > units )
+		count = units;
+
+	if ( count <= 1 )
+	{
+		fn(ud, first, end);
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+
+	jobFunc = fn;
+	jobData = ud;
+	jobBands = count;
+
+	for ( unsigned int i = 0; i < count; ++i )
+		jobEdges[i] = first + units * i / count * align;
+
+	jobEdges[count] = end;
+	busy = count - 1;
+	++generation;
+
+	pthread_cond_broadcast(&start);
+	pthread_mutex_unlock(&lock);
+
+	fn(ud, jobEdges[0], jobEdges[1]);
+
+	pthread_mutex_lock(&lock);
+
+	while ( busy > 0 )
+		pthread_cond_wait(&finished, &lock);
+
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,25 @@
+//
+//  bands.h
+//  MirrorJr
+//
+//  A small pool of threads that splits a run of rows into bands and works on
+//  them in parallel, for per-pixel work that's too slow on one Pi core.
+//
+
+#ifndef bands_h
+#define bands_h
+
+#include <stdbool.h>
+
+typedef void (*BandFunc)(void* ud, unsigned int first, unsigned int end);
+
+// starts count-1 workers, the caller is the last one
+bool bands_init(unsigned int count);
+unsigned int bands_count(void);
+
+// calls fn on bands covering rows first..end-1 and returns when they're all
+// done. Band edges are first plus a multiple of align. Short runs aren't
+// worth waking anyone for and go on fewer bands.
+void bands_run(BandFunc fn, void* ud, unsigned int first, unsigned int end, unsigned int align);
+
+#endif /* bands_h */
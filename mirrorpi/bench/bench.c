@@ -0,0 +1,521 @@
+//
+//  bench.c
+//  MirrorJr
+//
+//  Microbenchmarks for the hot paths: RingBuffer throughput, stream parsing,
+//  framebuffer conversion and audio resampling. Each test runs several times
+//  and reports the best run, which is the most repeatable number on a busy Pi.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ringbuffer.h"
+#include "stream.h"
+#include "convert.h"
+#include "resample.h"
+#include "streamgen.h"
+
+#define RUNS 5
+
+extern unsigned int bench_frames;
+
+static double now_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void report(const char* name, double sec, double bytes, double frames)
+{
+	printf("%-28s %8.3f ns/byte %10.1f MB/s", name, sec * 1e9 / bytes, bytes / sec / 1e6);
+
+	if ( frames > 0 )
+		printf(" %10.1f frames/s", frames / sec);
+
+	printf("\n");
+}
+
+static void benchRingBuffer(const char* name, unsigned int chunk)
+{
+	RingBuffer r;
+	RingBuffer_init(&r);
+	RingBuffer_setSize(&r, 65536, 1);
+
+	uint8_t in[4096], out[4096];
+	memset(in, 0x5a, sizeof(in));
+
+	const unsigned int total = 64 * 1024 * 1024;
+	double best = 1e9;
+
+	for ( int run = 0; run < RUNS; ++run )
+	{
+		double start = now_sec();
+
+		for ( unsigned int n = 0; n < total; n += chunk )
+		{
+			RingBuffer_addData(&r, in, chunk);
+			RingBuffer_readData(&r, out, chunk);
+		}
+
+		double t = now_sec() - start;
+
+		if ( t < best )
+			best = t;
+	}
+
+	report(name, best, total, 0);
+	RingBuffer_deinit(&r);
+}
+
+static void benchStream(const char* name, unsigned int rowsChanged)
+{
+	StreamGenConfig cfg = { .frames = 2000, .fps = 30, .rowsChanged = rowsChanged, .seed = 1 };
+	size_t len;
+	uint8_t* data = streamgen_generate(&cfg, &len);
+
+	stream_init();
+
+	double best = 1e9;
+	unsigned int frames = 0;
+
+	for ( int run = 0; run < RUNS; ++run )
+	{
+		stream_reset();
+		stream_begin();
+		bench_frames = 0;
+
+		double start = now_sec();
+
+		// same chunking as replay, small enough that the ring never fills
+		for ( size_t pos = 0; pos < len; pos += 4096 )
+		{
+			stream_addData(data + pos, len - pos < 4096 ? (unsigned int)(len - pos) : 4096);
+			stream_process();
+		}
+
+		double t = now_sec() - start;
+
+		if ( t < best )
+			best = t;
+
+		frames = bench_frames;
+	}
+
+	if ( frames != cfg.frames )
+		printf("%s: parsed %u frames, expected %u\n", name, frames, cfg.frames);
+
+	report(name, best, len, frames);
+	free(data);
+}
+
+// the original bit-at-a-time converter, for checking the optimized one against
+static void convertRef_1bit(const uint8_t* in, uint32_t* out, const uint32_t palette[2], unsigned int firstRow, unsigned int numRows)
+{
+	for ( unsigned int y = firstRow; y < firstRow + numRows; ++y )
+	{
+		for ( unsigned int x = 0; x < FRAME_WIDTH / 8; ++x )
+		{
+			uint8_t src_bits = in[x + y * ROW_SIZE_BYTES];
+
+			for ( unsigned int bit = 0; bit < 8; bit++ )
+				out[x * 8 + bit + y * FRAME_WIDTH] = (src_bits & (0x80 >> bit)) ? palette[1] : palette[0];
+		}
+	}
+}
+
+static void convertRef_4bit_2x2(const uint8_t* in, uint32_t* out, const uint32_t palette[16], unsigned int firstRow, unsigned int numRows)
+{
+	for ( unsigned int y = firstRow; y < firstRow + numRows; y += 2 )
+	{
+		for ( unsigned int x = 0; x < FRAME_WIDTH / 8; ++x )
+		{
+			uint8_t src_bits1 = in[x + y * ROW_SIZE_BYTES];
+			uint8_t src_bits2 = in[x + (y+1) * ROW_SIZE_BYTES];
+
+			for ( unsigned int bit = 0; bit < 8; bit += 2 )
+			{
+				unsigned int bitmask1 = 0x80 >> bit;
+				unsigned int bitmask2 = 0x80 >> (bit+1);
+				unsigned int idx =
+					((src_bits1 & bitmask1) ? 8 : 0) |
+					((src_bits1 & bitmask2) ? 4 : 0) |
+					((src_bits2 & bitmask1) ? 2 : 0) |
+					((src_bits2 & bitmask2) ? 1 : 0);
+				unsigned int out_i = x * 8 + bit + y * FRAME_WIDTH;
+
+				out[out_i] = out[out_i+1] = out[out_i+FRAME_WIDTH] = out[out_i+FRAME_WIDTH+1] = palette[idx];
+			}
+		}
+	}
+}
+
+static bool checkConvert()
+{
+	static uint8_t in[FRAME_SIZE_BYTES];
+	static uint32_t out[FRAME_WIDTH * FRAME_HEIGHT];
+	static uint32_t ref[FRAME_WIDTH * FRAME_HEIGHT];
+	const uint32_t palettes[3][2] = { { 0xff000000, 0xffb1afa8 }, { 0xff123456, 0xfffedcba }, { 0xffffffff, 0xff000000 } };
+	bool ok = true;
+
+	srand(3);
+
+	for ( unsigned int i = 0; i < sizeof(in); ++i )
+		in[i] = (uint8_t)rand();
+
+	// palette changes between calls, and partial spans leave the rest alone
+	for ( int p = 0; p < 3; ++p )
+	{
+		memset(out, 0x55, sizeof(out));
+		memset(ref, 0x55, sizeof(ref));
+		convertTo32Bit_1bit(in, out, FRAME_WIDTH * 4, palettes[p], 0, FRAME_HEIGHT);
+		convertRef_1bit(in, ref, palettes[p], 0, FRAME_HEIGHT);
+		convertTo32Bit_1bit(in + 7, out + 10 * FRAME_WIDTH, FRAME_WIDTH * 4, palettes[(p+1)%3], 10, 33);
+		convertRef_1bit(in + 7, ref, palettes[(p+1)%3], 10, 33);
+
+		if ( memcmp(out, ref, sizeof(out)) != 0 )
+		{
+			printf("convert 1bit: output doesn't match the reference with palette %i\n", p);
+			ok = false;
+		}
+	}
+
+	uint32_t palette16[16];
+
+	for ( int i = 0; i < 16; ++i )
+		palette16[i] = 0xff000000 | (uint32_t)rand();
+
+	memset(out, 0x55, sizeof(out));
+	memset(ref, 0x55, sizeof(ref));
+	convertTo32Bit_4bit_2x2(in, out, FRAME_WIDTH * 4, palette16, 0, FRAME_HEIGHT);
+	convertRef_4bit_2x2(in, ref, palette16, 0, FRAME_HEIGHT);
+	convertTo32Bit_4bit_2x2(in + 3, out + 100 * FRAME_WIDTH, FRAME_WIDTH * 4, palette16, 100, 42);
+	convertRef_4bit_2x2(in + 3, ref, palette16, 100, 42);
+
+	if ( memcmp(out, ref, sizeof(out)) != 0 )
+	{
+		printf("convert 4bit 2x2: output doesn't match the reference\n");
+		ok = false;
+	}
+
+	// indexed output: run the reference with the index as the color and compare against the planes
+	static uint8_t planeY[FRAME_WIDTH * FRAME_HEIGHT];
+	static uint8_t planeU[FRAME_WIDTH * FRAME_HEIGHT / 4];
+	static uint8_t planeV[FRAME_WIDTH * FRAME_HEIGHT / 4];
+	uint8_t yuv[16][3];
+	const uint32_t identity[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+	const uint8_t values[2] = { 0x20, 0xd0 };
+
+	convertPaletteToYUV(palette16, yuv, 16);
+	convertToYUV_4bit_2x2(in, planeY, FRAME_WIDTH, planeU, planeV, FRAME_WIDTH / 2, (const uint8_t (*)[3])yuv, 0, FRAME_HEIGHT);
+	convertRef_4bit_2x2(in, ref, identity, 0, FRAME_HEIGHT);
+
+	for ( unsigned int i = 0; i < FRAME_WIDTH * FRAME_HEIGHT; ++i )
+	{
+		unsigned int x = i % FRAME_WIDTH, y = i / FRAME_WIDTH;
+		unsigned int c = (y / 2) * (FRAME_WIDTH / 2) + x / 2;
+
+		if ( planeY[i] != yuv[ref[i]][0] || planeU[c] != yuv[ref[i]][1] || planeV[c] != yuv[ref[i]][2] )
+		{
+			printf("convert 4bit 2x2 yuv: wrong output at %u,%u\n", x, y);
+			ok = false;
+			break;
+		}
+	}
+
+	convertTo8Bit_1bit(in, planeY, FRAME_WIDTH, values, 0, FRAME_HEIGHT);
+	const uint32_t values32[2] = { values[0], values[1] };
+	convertRef_1bit(in, ref, values32, 0, FRAME_HEIGHT);
+
+	for ( unsigned int i = 0; i < FRAME_WIDTH * FRAME_HEIGHT; ++i )
+	{
+		if ( planeY[i] != ref[i] )
+		{
+			printf("convert 1bit 8-bit: wrong output at pixel %u\n", i);
+			ok = false;
+			break;
+		}
+	}
+
+	// texture rows are usually padded out past the frame width
+	static uint32_t padded[(FRAME_WIDTH + 16) * FRAME_HEIGHT];
+	const unsigned int stride = FRAME_WIDTH + 16;
+
+	for ( int fourbit = 0; fourbit < 2; ++fourbit )
+	{
+		if ( fourbit )
+		{
+			convertTo32Bit_4bit_2x2(in, padded, stride * 4, palette16, 0, FRAME_HEIGHT);
+			convertRef_4bit_2x2(in, ref, palette16, 0, FRAME_HEIGHT);
+		}
+		else
+		{
+			convertTo32Bit_1bit(in, padded, stride * 4, palettes[0], 0, FRAME_HEIGHT);
+			convertRef_1bit(in, ref, palettes[0], 0, FRAME_HEIGHT);
+		}
+
+		for ( unsigned int y = 0; y < FRAME_HEIGHT; ++y )
+		{
+			if ( memcmp(padded + y * stride, ref + y * FRAME_WIDTH, FRAME_WIDTH * 4) != 0 )
+			{
+				printf("convert %s: wrong output with a padded pitch\n", fourbit ? "4bit 2x2" : "1bit");
+				ok = false;
+				break;
+			}
+		}
+	}
+
+	return ok;
+}
+
+// rows per frame starting at a different place each time, like a game redrawing a band of the screen
+static void benchConvert(const char* name, int fourbit, unsigned int rows, bool reference)
+{
+	static uint8_t in[FRAME_SIZE_BYTES];
+	static uint32_t out[FRAME_WIDTH * FRAME_HEIGHT];
+	uint32_t palette[16];
+
+	srand(2);
+
+	for ( unsigned int i = 0; i < sizeof(in); ++i )
+		in[i] = (uint8_t)rand();
+
+	for ( int i = 0; i < 16; ++i )
+		palette[i] = 0xff000000 | (uint32_t)(i * 0x111111);
+
+	const unsigned int frames = 500;
+	double best = 1e9;
+
+	for ( int run = 0; run < RUNS; ++run )
+	{
+		double start = now_sec();
+
+		for ( unsigned int f = 0; f < frames; ++f )
+		{
+			in[f % sizeof(in)] ^= 1; // keep the compiler from hoisting anything
+
+			unsigned int first = (f * 2 * 7) % (FRAME_HEIGHT - rows + 1) & ~1u;
+
+			if ( reference && fourbit )
+				convertRef_4bit_2x2(in, out, palette, first, rows);
+			else if ( reference )
+				convertRef_1bit(in, out, palette, first, rows);
+			else if ( fourbit )
+				convertTo32Bit_4bit_2x2(in, out + first * FRAME_WIDTH, FRAME_WIDTH * 4, palette, first, rows);
+			else
+				convertTo32Bit_1bit(in, out + first * FRAME_WIDTH, FRAME_WIDTH * 4, palette, first, rows);
+		}
+
+		double t = now_sec() - start;
+
+		if ( t < best )
+			best = t;
+	}
+
+	report(name, best, (double)frames * rows * ROW_SIZE_BYTES, frames);
+}
+
+// Feeds in (frames of channels samples) through r in uneven pieces, the way
+// the audio callback sees the ring, until outFrames are written or the input
+// runs out. Returns the frames written, *consumed the input used.
+static unsigned int resampleChunked(Resampler* r, const int16_t* in, unsigned int inFrames, unsigned int* consumed, int16_t* out, unsigned int outFrames)
+{
+	static const unsigned int inChunks[] = { 1, 2, 4, 5, 7, 13, 29, 64, 100, 333, 512, 1470 };
+	static const unsigned int outChunks[] = { 3, 8, 9, 17, 128, 255, 512, 1024 };
+	unsigned int used = 0, produced = 0;
+
+	for ( unsigned int k = 0; produced < outFrames; ++k )
+	{
+		unsigned int n = inChunks[k % (sizeof(inChunks) / sizeof(inChunks[0]))];
+		unsigned int m = outChunks[k % (sizeof(outChunks) / sizeof(outChunks[0]))];
+		unsigned int u;
+
+		if ( n > inFrames - used )
+			n = inFrames - used;
+
+		if ( m > outFrames - produced )
+			m = outFrames - produced;
+
+		unsigned int p = resample_run(r, in + used * r->channels, n, &u, out + 2 * produced, m);
+
+		used += u;
+		produced += p;
+
+		if ( p == 0 && used == inFrames )
+			break;
+	}
+
+	*consumed = used;
+	return produced;
+}
+
+#define RESAMPLE_FRAMES 44100
+#define RESAMPLE_DELAY 3 // frames of history ahead of the input at a ratio of 1
+
+static bool checkResample()
+{
+	static int16_t in[RESAMPLE_FRAMES * 2];
+	static int16_t out[(RESAMPLE_FRAMES + RESAMPLE_FRAMES / 100) * 2];
+	const unsigned int outFrames = sizeof(out) / sizeof(out[0]) / 2;
+	bool ok = true;
+
+	srand(4);
+
+	for ( unsigned int i = 0; i < RESAMPLE_FRAMES * 2; ++i )
+		in[i] = (int16_t)rand();
+
+	// at 1x it's a copy (mono upmixed by the SIMD path, in pieces that aren't multiples of 8), a few frames late
+	for ( unsigned int channels = 1; channels <= 2; ++channels )
+	{
+		Resampler r;
+		unsigned int used;
+
+		resample_init(&r, channels);
+		memset(out, 0x55, sizeof(out));
+
+		unsigned int n = resampleChunked(&r, in, RESAMPLE_FRAMES, &used, out, outFrames);
+
+		// the last few frames stay in history until more input comes
+		if ( used != RESAMPLE_FRAMES || n < RESAMPLE_FRAMES )
+		{
+			printf("resample 1x %s: %u frames out for %u in\n", channels == 1 ? "mono" : "stereo", n, used);
+			ok = false;
+		}
+
+		for ( unsigned int i = 0; i < n; ++i )
+		{
+			int16_t l = 0, rt = 0;
+
+			if ( i >= RESAMPLE_DELAY )
+			{
+				l = in[(i - RESAMPLE_DELAY) * channels];
+				rt = in[(i - RESAMPLE_DELAY) * channels + channels - 1];
+			}
+
+			if ( out[2 * i] != l || out[2 * i + 1] != rt )
+			{
+				printf("resample 1x %s: frame %u is %i,%i, should be %i,%i\n", channels == 1 ? "mono" : "stereo",
+					   i, out[2 * i], out[2 * i + 1], l, rt);
+				ok = false;
+				break;
+			}
+		}
+	}
+
+	// the upmix under the mono copy path against the scalar loop, at lengths
+	// that leave a tail after the 8-wide SIMD part, and nothing written past the end
+	for ( unsigned int len = 5; len < 80; ++len )
+	{
+		Resampler r;
+		unsigned int used;
+
+		resample_init(&r, 1);
+		memset(out, 0x55, sizeof(out));
+
+		unsigned int n = resample_run(&r, in, len, &used, out, len + 1);
+		bool match = n == len + 1 && used == len && out[2 * n] == 0x5555 && out[2 * n + 1] == 0x5555;
+
+		for ( unsigned int i = 0; match && i < n; ++i )
+		{
+			int16_t ref = i < RESAMPLE_DELAY ? 0 : in[i - RESAMPLE_DELAY];
+			match = out[2 * i] == ref && out[2 * i + 1] == ref;
+		}
+
+		if ( !match )
+		{
+			printf("resample mono upmix: wrong output upmixing %u frames\n", len - 2);
+			ok = false;
+			break;
+		}
+	}
+
+	// off 1x the output count follows the ratio, within the 16.16 step's rounding
+	static const double ratios[] = { 1.002, 0.998 };
+
+	for ( unsigned int k = 0; k < 2; ++k )
+	{
+		Resampler r;
+		unsigned int used;
+
+		resample_init(&r, 2);
+		resample_setRatio(&r, ratios[k]);
+
+		unsigned int n = resampleChunked(&r, in, RESAMPLE_FRAMES, &used, out, outFrames);
+		double measured = (double)used / n;
+
+		if ( used < RESAMPLE_FRAMES - 1 || measured < ratios[k] - 1e-4 || measured > ratios[k] + 1e-4 )
+		{
+			printf("resample %.3fx: %u frames out for %u in, ratio %.5f\n", ratios[k], n, used, measured);
+			ok = false;
+		}
+	}
+
+	return ok;
+}
+
+static void benchResample(const char* name, unsigned int channels, double ratio)
+{
+	static int16_t in[RESAMPLE_FRAMES * 2];
+	static int16_t out[512 * 2];
+	Resampler r;
+
+	for ( unsigned int i = 0; i < RESAMPLE_FRAMES * 2; ++i )
+		in[i] = (int16_t)(i * 37);
+
+	double best = 1e9;
+	unsigned int produced = 0;
+
+	for ( int run = 0; run < RUNS; ++run )
+	{
+		resample_init(&r, channels);
+		resample_setRatio(&r, ratio);
+		produced = 0;
+
+		double start = now_sec();
+
+		// 512-frame callbacks over a second of audio
+		for ( unsigned int used = 0, u; used < RESAMPLE_FRAMES - 1024; used += u )
+			produced += resample_run(&r, in + used * channels, RESAMPLE_FRAMES - used, &u, out, 512);
+
+		double t = now_sec() - start;
+
+		if ( t < best )
+			best = t;
+	}
+
+	printf("%-28s %8.3f ns/frame %10.0fx realtime\n", name, best * 1e9 / produced, produced / best / 44100);
+}
+
+int main(int argc, const char* argv[])
+{
+	printf("(converter ns/byte is per input byte, %s kernels)\n", convert_simd());
+
+	benchRingBuffer("ringbuffer 2 byte", 2);
+	benchRingBuffer("ringbuffer 64 byte", 64);
+	benchRingBuffer("ringbuffer 4096 byte", 4096);
+
+	benchStream("stream mixed rows", 0);
+	benchStream("stream full frames", FRAME_HEIGHT);
+	benchStream("stream 16 rows", 16);
+
+	bool ok = checkConvert();
+
+	benchConvert("convert 1bit reference", 0, FRAME_HEIGHT, true);
+	benchConvert("convert 1bit", 0, FRAME_HEIGHT, false);
+	benchConvert("convert 1bit 16 rows", 0, 16, false);
+	benchConvert("convert 4bit 2x2 reference", 1, FRAME_HEIGHT, true);
+	benchConvert("convert 4bit 2x2", 1, FRAME_HEIGHT, false);
+	benchConvert("convert 4bit 2x2 16 rows", 1, 16, false);
+
+	ok &= checkResample();
+
+	benchResample("resample 1x stereo", 2, 1.0);
+	benchResample("resample 1x mono", 1, 1.0);
+	benchResample("resample 1.002x stereo", 2, 1.002);
+	benchResample("resample 1.002x mono", 1, 1.002);
+
+	return ok ? 0 : 1;
+}
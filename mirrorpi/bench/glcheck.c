@@ -0,0 +1,237 @@
+//
+//  glcheck.c
+//  MirrorJr
+//
+//  Runs glframe.c's shaders offscreen on an EGL pbuffer, no window or display
+//  needed (Mesa's llvmpipe does fine: EGL_PLATFORM=surfaceless), reads the
+//  result back and compares every pixel against the CPU converters, for
+//  1-bit and 4-bit frames, full and partial updates. Then times
+//  update + draw against converting on the CPU.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES2/gl2.h>
+
+#include "glframe.h"
+#include "convert.h"
+#include "constants.h"
+
+#define SCALE 3
+#define WIDTH (FRAME_WIDTH * SCALE)
+#define HEIGHT (FRAME_HEIGHT * SCALE)
+#define FRAMES 300
+
+static double now_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static bool initEGL()
+{
+	EGLDisplay display = EGL_NO_DISPLAY;
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+	if ( getPlatformDisplay != NULL && getenv("EGL_PLATFORM") == NULL )
+		display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+#endif
+
+	if ( display == EGL_NO_DISPLAY )
+		display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+	if ( display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL) )
+	{
+		printf("couldn't initialize EGL (%x)\n", eglGetError());
+		return false;
+	}
+
+	static const EGLint configAttrs[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+		EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8,
+		EGL_NONE
+	};
+	static const EGLint surfaceAttrs[] = { EGL_WIDTH, WIDTH, EGL_HEIGHT, HEIGHT, EGL_NONE };
+	static const EGLint contextAttrs[] = { EGL_CONTEXT_CLIENT_VERSION, 2, EGL_NONE };
+	EGLConfig config;
+	EGLint count;
+
+	eglBindAPI(EGL_OPENGL_ES_API);
+
+	if ( !eglChooseConfig(display, configAttrs, &config, 1, &count) || count == 0 )
+	{
+		printf("no pbuffer config with GLES2 (%x)\n", eglGetError());
+		return false;
+	}
+
+	EGLSurface surface = eglCreatePbufferSurface(display, config, surfaceAttrs);
+	EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttrs);
+
+	if ( surface == EGL_NO_SURFACE || context == EGL_NO_CONTEXT || !eglMakeCurrent(display, surface, surface, context) )
+	{
+		printf("couldn't make a GLES2 context current (%x)\n", eglGetError());
+		return false;
+	}
+
+	printf("GL_RENDERER %s\n", (const char*)glGetString(GL_RENDERER));
+	return true;
+}
+
+static void convertCPU(const OutputFrame* f, uint32_t* out)
+{
+	if ( f->mode == kFrame1bit )
+		convertTo32Bit_1bit(f->bits, out, FRAME_WIDTH * 4, f->palette, 0, FRAME_HEIGHT);
+	else
+		convertTo32Bit_4bit_2x2(f->bits, out, FRAME_WIDTH * 4, f->palette, 0, FRAME_HEIGHT);
+}
+
+// reads the drawing back (bottom up, RGBA) and checks each screen pixel against its source pixel
+static bool compare(const char* name, const OutputFrame* f)
+{
+	static uint32_t ref[FRAME_WIDTH * FRAME_HEIGHT];
+	static uint8_t pixels[WIDTH * HEIGHT * 4];
+
+	convertCPU(f, ref);
+	glReadPixels(0, 0, WIDTH, HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+
+	unsigned int bad = 0;
+
+	for ( unsigned int y = 0; y < HEIGHT; ++y )
+	{
+		for ( unsigned int x = 0; x < WIDTH; ++x )
+		{
+			const uint8_t* p = pixels + ((HEIGHT - 1 - y) * WIDTH + x) * 4;
+			uint32_t got = 0xff000000u | ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+			uint32_t want = ref[(y / SCALE) * FRAME_WIDTH + x / SCALE];
+
+			if ( got != want && bad++ == 0 )
+				printf("%s: pixel %u,%u is %08x, should be %08x\n", name, x, y, got, want);
+		}
+	}
+
+	if ( bad > 0 )
+		printf("%s: %u pixels wrong\n", name, bad);
+
+	return bad == 0;
+}
+
+static void randomize(OutputFrame* f, unsigned int first, unsigned int end)
+{
+	for ( unsigned int i = first * LCD_ROWSIZE; i < end * LCD_ROWSIZE; ++i )
+		f->bits[i] = (uint8_t)rand();
+
+	for ( unsigned int row = first; row < end; ++row )
+		f->dirtyRows[row/8] |= (uint8_t)(1 << (row%8));
+}
+
+static void clean(OutputFrame* f)
+{
+	memset(f->dirtyRows, 0, sizeof(f->dirtyRows));
+	f->allDirty = false;
+}
+
+static bool check(OutputFrame* f, const char* name)
+{
+	bool ok = true;
+	char label[64];
+
+	f->allDirty = true;
+	randomize(f, 0, FRAME_HEIGHT);
+	glframe_update(f);
+	glframe_draw(WIDTH, HEIGHT);
+	snprintf(label, sizeof(label), "%s full", name);
+	ok &= compare(label, f);
+	clean(f);
+
+	// odd rows in the middle of a 2x2 block, the update has to round out to whole blocks
+	randomize(f, 37, 38);
+	randomize(f, 101, 160);
+	glframe_update(f);
+	glframe_draw(WIDTH, HEIGHT);
+	snprintf(label, sizeof(label), "%s partial", name);
+	ok &= compare(label, f);
+	clean(f);
+
+	return ok;
+}
+
+static void bench(OutputFrame* f, const char* name, unsigned int rows)
+{
+	static uint32_t out[FRAME_WIDTH * FRAME_HEIGHT];
+
+	double start = now_sec();
+
+	for ( unsigned int i = 0; i < FRAMES; ++i )
+	{
+		randomize(f, (i * 14) % (FRAME_HEIGHT - rows + 1), (i * 14) % (FRAME_HEIGHT - rows + 1) + rows);
+		glframe_update(f);
+		glframe_draw(WIDTH, HEIGHT);
+		glFinish();
+		clean(f);
+	}
+
+	double gl = now_sec() - start;
+	start = now_sec();
+
+	for ( unsigned int i = 0; i < FRAMES; ++i )
+	{
+		unsigned int first = (i * 14) % (FRAME_HEIGHT - rows + 1);
+
+		if ( f->mode == kFrame1bit )
+			convertTo32Bit_1bit(f->bits, out + first * FRAME_WIDTH, FRAME_WIDTH * 4, f->palette, first, rows);
+		else
+			convertTo32Bit_4bit_2x2(f->bits, out + (first & ~1u) * FRAME_WIDTH, FRAME_WIDTH * 4, f->palette, first & ~1u, rows);
+	}
+
+	double cpu = now_sec() - start;
+
+	printf("%-20s shader %8.1f frames/s, %5.1f KB uploaded | cpu convert only %8.1f frames/s, %5.1f KB\n", name,
+		   FRAMES / gl, rows * LCD_ROWSIZE / 1024.0, FRAMES / cpu, rows * FRAME_WIDTH * 4 / 1024.0);
+}
+
+int main(int argc, const char* argv[])
+{
+	if ( !initEGL() || !glframe_init() )
+		return -1;
+
+	static OutputFrame frame;
+	bool ok = true;
+
+	frame.mode = kFrame1bit;
+	frame.palette[0] = 0xff000000;
+	frame.palette[1] = 0xffb1afa8;
+	ok &= check(&frame, "1bit");
+
+	frame.mode = kFrame4bit_2x2;
+
+	for ( int i = 0; i < 16; ++i )
+		frame.palette[i] = 0xff000000 | (uint32_t)rand();
+
+	ok &= check(&frame, "4bit");
+
+	if ( glGetError() != GL_NO_ERROR )
+	{
+		printf("GL error\n");
+		ok = false;
+	}
+
+	printf("%s\n", ok ? "shader output matches" : "shader output doesn't match");
+
+	frame.mode = kFrame1bit;
+	frame.allDirty = true;
+	bench(&frame, "1bit full", FRAME_HEIGHT);
+	bench(&frame, "1bit 16 rows", 16);
+	frame.mode = kFrame4bit_2x2;
+	frame.allDirty = true;
+	bench(&frame, "4bit full", FRAME_HEIGHT);
+
+	return ok ? 0 : -1;
+}
@@ -0,0 +1,134 @@
+//
+//  presentbench.c
+//  MirrorJr
+//
+//  Runs frame_present() against a real SDL renderer with the RGBA and the
+//  indexed (IYUV) upload paths, full frames, 16 changed rows and a frame
+//  resent unchanged, 1-bit and 4-bit. Vsync is off, so frames/s is the CPU +
+//  upload cost of a frame. Each frame is waited for, pass --nosync to see how
+//  many the render thread drops when the producer runs flat out. Set
+//  SDL_VIDEODRIVER/SDL_RENDER_DRIVER to try other SDL backends, or --output
+//  null/raw:<file> to leave the GPU out of it. Compare --output
+//  sdl:window,upscale with the default to see whether the CPU upscaler or the
+//  GPU's stretch is cheaper on a given cabinet.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "frame.h"
+#include "constants.h"
+
+#define FRAMES 600
+
+// frame.c reports to the input test, which would send its button presses through stream.c
+void stream_sendButtonPress(int btn) {}
+void stream_sendButtonRelease(int btn) {}
+
+static bool sync = true;
+
+static double now_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// still resends the same rows every frame, like a pause screen
+static void run(const char* name, bool indexed, bool fourbit, unsigned int rows, bool still)
+{
+	static const RGB palette4[16] = {
+		{0x00,0x00,0x00}, {0x1d,0x2b,0x53}, {0x7e,0x25,0x53}, {0x00,0x87,0x51},
+		{0xab,0x52,0x36}, {0x5f,0x57,0x4f}, {0xc2,0xc3,0xc7}, {0xff,0xf1,0xe8},
+		{0xff,0x00,0x4d}, {0xff,0xa3,0x00}, {0xff,0xec,0x27}, {0x00,0xe4,0x36},
+		{0x29,0xad,0xff}, {0x83,0x76,0x9c}, {0xff,0x77,0xa8}, {0xff,0xcc,0xaa},
+	};
+	uint8_t row[ROW_SIZE_BYTES];
+
+	frame_reset();
+
+	if ( fourbit )
+		frame_set4BitPalette(palette4);
+
+	frame_setIndexed(indexed);
+	frame_present();
+	frame_sync();
+
+	FrameStats before;
+	frame_getStats(&before);
+	double start = now_sec();
+
+	for ( unsigned int f = 0; f < FRAMES; ++f )
+	{
+		unsigned int first = (f * 14) % (FRAME_HEIGHT - rows + 1);
+
+		for ( unsigned int r = 0; r < rows; ++r )
+		{
+			for ( unsigned int x = 0; x < ROW_SIZE_BYTES; ++x )
+				row[x] = (uint8_t)((still ? 0 : f * 31) + r * 7 + x);
+
+			frame_setRow(first + r + 1, row);
+		}
+
+		frame_present();
+
+		if ( sync )
+			frame_sync();
+	}
+
+	frame_sync();
+
+	double t = now_sec() - start;
+	double bytesPerPixel = indexed ? 1.5 : 4;
+	FrameStats after;
+	frame_getStats(&after);
+
+	unsigned int unchanged = after.unchanged - before.unchanged;
+
+	printf("%-28s %10.1f frames/s %8.1f KB uploaded/frame %5u skipped %5u unchanged\n", name, FRAMES / t,
+		   rows * FRAME_WIDTH * bytesPerPixel / 1024 * (FRAMES - unchanged) / FRAMES, after.skipped - before.skipped, unchanged);
+}
+
+int main(int argc, const char* argv[])
+{
+	const char* output = "sdl:window";
+
+	for ( int i = 1; i < argc; ++i )
+	{
+		if ( strcmp(argv[i], "--nosync") == 0 )
+			sync = false;
+		else if ( strcmp(argv[i], "--output") == 0 && i+1 < argc )
+			output = argv[++i];
+		else
+		{
+			printf("usage: %s [--nosync] [--output <spec>]\n", argv[0]);
+			return -1;
+		}
+	}
+
+	if ( !frame_init(output) )
+		return -1;
+
+	run("rgba 1bit", false, false, FRAME_HEIGHT, false);
+	run("rgba 1bit 16 rows", false, false, 16, false);
+	run("rgba 4bit", false, true, FRAME_HEIGHT, false);
+	run("rgba 4bit 16 rows", false, true, 16, false);
+	run("rgba 1bit still", false, false, FRAME_HEIGHT, true);
+
+	if ( !frame_setIndexed(true) )
+	{
+		printf("skipping indexed\n");
+		frame_report();
+		return 0;
+	}
+
+	run("indexed 1bit", true, false, FRAME_HEIGHT, false);
+	run("indexed 1bit 16 rows", true, false, 16, false);
+	run("indexed 4bit", true, true, FRAME_HEIGHT, false);
+	run("indexed 4bit 16 rows", true, true, 16, false);
+
+	frame_report();
+	return 0;
+}
@@ -0,0 +1,114 @@
+//
+//  streamgen.c
+//  MirrorJr
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "streamgen.h"
+#include "stream.h"
+
+static size_t putHeader(uint8_t* buf, uint8_t opcode, uint8_t arg, uint16_t len)
+{
+	MessageHeader hdr = { .opcode = opcode, .unused = arg, .payload_length = len };
+	memcpy(buf, &hdr, sizeof(hdr));
+	return sizeof(hdr);
+}
+
+size_t streamgen_putFullFrame(uint8_t* buf, uint32_t timestamp_ms, const uint8_t* frame, const uint8_t rowmask[30])
+{
+	unsigned int rows = 0;
+
+	for ( int i = 0; i < FRAME_HEIGHT; ++i )
+		rows += (rowmask[i/8] >> (i%8)) & 1;
+
+	size_t n = putHeader(buf, OPCODE_FULL_FRAME, (uint8_t)rows, (uint16_t)(sizeof(MessageFrameData) + rows * ROW_SIZE_BYTES));
+
+	MessageFrameData fd = { .timestamp_ms = timestamp_ms };
+	memcpy(fd.rowmask, rowmask, sizeof(fd.rowmask));
+	memcpy(buf + n, &fd, sizeof(fd));
+	n += sizeof(fd);
+
+	for ( int i = 0; i < FRAME_HEIGHT; ++i )
+	{
+		if ( rowmask[i/8] & (1 << (i%8)) )
+		{
+			memcpy(buf + n, frame + i * ROW_SIZE_BYTES, ROW_SIZE_BYTES);
+			n += ROW_SIZE_BYTES;
+		}
+	}
+
+	return n;
+}
+
+size_t streamgen_putAudioFrame(uint8_t* buf, const int16_t* samples, unsigned int len)
+{
+	size_t n = putHeader(buf, OPCODE_AUDIO_FRAME, 0, (uint16_t)len);
+	memcpy(buf + n, samples, len);
+	return n + len;
+}
+
+size_t streamgen_putDeviceState(uint8_t* buf, uint8_t buttons, uint16_t dropped, float crank)
+{
+	MessageDeviceState ds = { .buttonMask = buttons, .unused = dropped, .crankAngle = crank };
+	size_t n = putHeader(buf, OPCODE_DEVICE_STATE, 0, sizeof(ds));
+	memcpy(buf + n, &ds, sizeof(ds));
+	return n + sizeof(ds);
+}
+
+#define AUDIO_MESSAGE_SIZE 1470 // under the 2048 byte limit, 44.1kHz stereo is 2940 bytes per 60Hz frame
+
+uint8_t* streamgen_generate(const StreamGenConfig* cfg, size_t* outlen)
+{
+	unsigned int fps = cfg->fps > 0 ? cfg->fps : 30;
+	unsigned int audio_per_frame = 44100 * 4 / fps;
+	size_t maxframe = sizeof(MessageHeader) * 16 + sizeof(MessageFrameData) + FRAME_SIZE_BYTES + audio_per_frame + sizeof(MessageDeviceState);
+	static const char enable[] = "stream enable\r\n";
+
+	uint8_t* buf = malloc(strlen(enable) + maxframe * cfg->frames);
+	uint8_t frame[FRAME_SIZE_BYTES];
+	int16_t audio[AUDIO_MESSAGE_SIZE / 2];
+	size_t n = 0;
+
+	if ( buf == NULL )
+		return NULL;
+
+	srand(cfg->seed);
+
+	memcpy(buf, enable, strlen(enable));
+	n += strlen(enable);
+
+	for ( unsigned int i = 0; i < FRAME_SIZE_BYTES; ++i )
+		frame[i] = (uint8_t)rand();
+
+	for ( unsigned int i = 0; i < AUDIO_MESSAGE_SIZE / 2; ++i )
+		audio[i] = (int16_t)(rand() - RAND_MAX / 2);
+
+	for ( unsigned int f = 0; f < cfg->frames; ++f )
+	{
+		uint8_t rowmask[30] = {0};
+		unsigned int rows = cfg->rowsChanged > 0 ? cfg->rowsChanged : 1 + (unsigned int)rand() % FRAME_HEIGHT;
+		unsigned int start = (unsigned int)rand() % FRAME_HEIGHT;
+
+		for ( unsigned int r = 0; r < rows && r < FRAME_HEIGHT; ++r )
+		{
+			unsigned int row = (start + r) % FRAME_HEIGHT;
+			rowmask[row/8] |= (uint8_t)(1 << (row%8));
+			frame[row * ROW_SIZE_BYTES + f % ROW_SIZE_BYTES] ^= 0xff;
+		}
+
+		n += streamgen_putFullFrame(buf + n, f * 1000 / fps, frame, rowmask);
+
+		for ( unsigned int a = 0; a < audio_per_frame; a += AUDIO_MESSAGE_SIZE )
+		{
+			unsigned int len = audio_per_frame - a < AUDIO_MESSAGE_SIZE ? audio_per_frame - a : AUDIO_MESSAGE_SIZE;
+			n += streamgen_putAudioFrame(buf + n, audio, len & ~3u);
+		}
+
+		n += streamgen_putDeviceState(buf + n, 0, 0, 0);
+	}
+
+	*outlen = n;
+	return buf;
+}
@@ -0,0 +1,32 @@
+//
+//  streamgen.h
+//  MirrorJr
+//
+//  Synthetic Playdate stream generator for benchmarks: the "stream enable"
+//  echo followed by a mix of OPCODE_FULL_FRAME, OPCODE_AUDIO_FRAME and
+//  OPCODE_DEVICE_STATE messages, like a game running at a fixed frame rate.
+//
+
+#ifndef streamgen_h
+#define streamgen_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct
+{
+	unsigned int frames;
+	unsigned int fps; // sets how much audio goes with each frame
+	unsigned int rowsChanged; // rows per full frame message, 0 = random 1..240
+	unsigned int seed;
+} StreamGenConfig;
+
+// returns a malloc'd buffer, caller frees
+uint8_t* streamgen_generate(const StreamGenConfig* cfg, size_t* outlen);
+
+// appends a single message, returns the number of bytes written
+size_t streamgen_putFullFrame(uint8_t* buf, uint32_t timestamp_ms, const uint8_t* frame, const uint8_t rowmask[30]);
+size_t streamgen_putAudioFrame(uint8_t* buf, const int16_t* samples, unsigned int len);
+size_t streamgen_putDeviceState(uint8_t* buf, uint8_t buttons, uint16_t dropped, float crank);
+
+#endif /* streamgen_h */
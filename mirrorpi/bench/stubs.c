@@ -0,0 +1,37 @@
+//
+//  stubs.c
+//  MirrorJr
+//
+//  Stand-ins for the display, audio and serial modules so stream.c can be
+//  benchmarked on its own. They only count what they're given.
+//
+
+#include <stdbool.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "frame.h"
+#include "audio.h"
+#include "serial.h"
+
+unsigned int bench_frames = 0;
+unsigned int bench_rows = 0;
+unsigned int bench_audiobytes = 0;
+
+void frame_begin(uint32_t timestamp) {}
+void frame_setRow(unsigned int row, const uint8_t* data) { ++bench_rows; }
+void frame_end() { ++bench_frames; }
+void frame_reset() {}
+void frame_set1BitPalette(const RGB palette[2]) {}
+void frame_set4BitPalette(const RGB palette[16]) {}
+
+void audio_setFormat(unsigned int channels) {}
+void audio_addData(const uint8_t* data, unsigned int len) { bench_audiobytes += len; }
+void audio_addSilence(unsigned int len) {}
+
+bool ser_isOpen() { return false; }
+int ser_getFd() { return -1; }
+void ser_close() {}
+void ser_flush(void) {}
+ssize_t ser_write(const char* buffer, size_t size) { return (ssize_t)size; }
+ssize_t ser_writeNonblocking(const char* buffer, size_t size) { return (ssize_t)size; }
@@ -0,0 +1,424 @@
+//
+//  vplaydate.c
+//  MirrorJr
+//
+//  A pretend Playdate on a pseudo-terminal. It answers "stream enable" and
+//  "stream poke", sends full frames and audio at a fixed rate, and reports
+//  button and crank input in its device state with the next frame redrawn to
+//  match, so the mirror's input-to-frame latency and sustained throughput can
+//  be measured without hardware:
+//
+//    bench/vplaydate --seconds 10 -- ./mirror --once --input-test 250
+//
+//  The command after -- gets "--device <pty>" appended. Without one, the pty
+//  path is printed and vplaydate serves whoever opens it.
+//
+
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <termios.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "stream.h"
+#include "streamgen.h"
+
+#define AUDIO_MESSAGE_SIZE 1470
+
+static unsigned int fps = 30;
+static unsigned int rowsPerFrame = 16;
+static unsigned int sampleRate = 44100;
+static double seconds = 10;
+static double jitter = 0;
+
+static int master = -1;
+
+static bool streaming = false;
+static bool pokePending = false;
+static uint16_t audioFlags = 0;
+static bool audioChanged = false;
+
+static uint8_t buttons = 0;
+static float crank = 0;
+static bool inputChanged = false;
+
+static uint8_t frame[FRAME_SIZE_BYTES];
+static unsigned int frameNum = 0;
+static unsigned int nextRow = 0;
+
+static uint64_t bytesSent = 0;
+static unsigned int framesSent = 0;
+static unsigned int buttonCommands = 0;
+static unsigned int crankCommands = 0;
+static unsigned int pokes = 0;
+
+static double now_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static uint8_t buttonMask(char key)
+{
+	switch ( key )
+	{
+		case 'l': return 0x01;
+		case 'r': return 0x02;
+		case 'u': return 0x04;
+		case 'd': return 0x08;
+		case 'b': return 0x10;
+		case 'a': return 0x20;
+		case 'm': return 0x40;
+		default: return 0;
+	}
+}
+
+static bool sendAll(const uint8_t* buf, size_t len)
+{
+	while ( len > 0 )
+	{
+		ssize_t n = write(master, buf, len);
+
+		if ( n < 0 && errno == EAGAIN )
+		{
+			struct pollfd pfd = { .fd = master, .events = POLLOUT };
+			poll(&pfd, 1, 100);
+			continue;
+		}
+		else if ( n <= 0 )
+			return false;
+
+		buf += n;
+		len -= (size_t)n;
+		bytesSent += (uint64_t)n;
+	}
+
+	return true;
+}
+
+static void handleCommand(char* line)
+{
+	char key;
+	float change;
+
+	if ( strcmp(line, "stream enable") == 0 )
+	{
+		// the echo tells the mirror where the binary stream starts
+		sendAll((const uint8_t*)"stream enable\r\n", 15);
+		streaming = true;
+		inputChanged = true;
+	}
+	else if ( strcmp(line, "stream disable") == 0 )
+		streaming = false;
+	else if ( strcmp(line, "stream poke") == 0 )
+	{
+		++pokes;
+		pokePending = true;
+	}
+	else if ( strcmp(line, "stream a+") == 0 || strcmp(line, "stream am") == 0 || strcmp(line, "stream a-") == 0 )
+	{
+		audioFlags = line[8] == '-' ? 0 : line[8] == '+' ? STREAM_AUDIO_FLAG_ENABLED | STREAM_AUDIO_FLAG_STEREO : STREAM_AUDIO_FLAG_ENABLED;
+		audioChanged = true;
+	}
+	else if ( sscanf(line, "btn +%c", &key) == 1 )
+	{
+		++buttonCommands;
+		buttons |= buttonMask(key);
+		inputChanged = true;
+	}
+	else if ( sscanf(line, "btn -%c", &key) == 1 )
+	{
+		++buttonCommands;
+		buttons &= (uint8_t)~buttonMask(key);
+		inputChanged = true;
+	}
+	else if ( sscanf(line, "changecrank %f", &change) == 1 )
+	{
+		++crankCommands;
+		crank += change;
+		inputChanged = true;
+	}
+}
+
+static void readCommands()
+{
+	static char line[128];
+	static size_t len = 0;
+	char buf[512];
+	ssize_t n;
+
+	while ( (n = read(master, buf, sizeof(buf))) > 0 )
+	{
+		for ( ssize_t i = 0; i < n; ++i )
+		{
+			if ( buf[i] == '\r' || buf[i] == '\n' )
+			{
+				line[len] = '\0';
+
+				if ( len > 0 )
+					handleCommand(line);
+
+				len = 0;
+			}
+			else if ( len < sizeof(line) - 1 )
+				line[len++] = buf[i];
+		}
+	}
+}
+
+static bool sendFrame(double t)
+{
+	static uint8_t buf[sizeof(MessageHeader) * 4 + sizeof(MessageDeviceState) + sizeof(MessageFrameData) + FRAME_SIZE_BYTES];
+	static int16_t audio[AUDIO_MESSAGE_SIZE / 2];
+	uint8_t rowmask[FRAME_HEIGHT/8] = {0};
+	size_t n = 0;
+
+	if ( pokePending )
+	{
+		// echoed between messages, where the parser looks for it
+		memcpy(buf + n, "stream poke\r\n", 13);
+		n += 13;
+		pokePending = false;
+	}
+
+	if ( audioChanged )
+	{
+		MessageHeader hdr = { .opcode = OPCODE_AUDIO_CHANGE, .payload_length = sizeof(MessageAudioChange) };
+		MessageAudioChange ac = { .flags = audioFlags };
+		memcpy(buf + n, &hdr, sizeof(hdr));
+		memcpy(buf + n + sizeof(hdr), &ac, sizeof(ac));
+		n += sizeof(hdr) + sizeof(ac);
+		audioChanged = false;
+	}
+
+	// state first, so by the time the frame shows up the mirror knows what caused it
+	n += streamgen_putDeviceState(buf + n, buttons, 0, crank);
+
+	// input redraws everything: inverted while A is down, crank shifts the pattern
+	uint8_t ink = (uint8_t)((buttons & 0x20 ? 0xff : 0x00) ^ (uint8_t)(int)crank);
+	unsigned int rows = inputChanged ? FRAME_HEIGHT : rowsPerFrame;
+
+	for ( unsigned int r = 0; r < rows && r < FRAME_HEIGHT; ++r )
+	{
+		unsigned int row = (nextRow + r) % FRAME_HEIGHT;
+		memset(frame + row * ROW_SIZE_BYTES, ink ^ (uint8_t)(frameNum + row), ROW_SIZE_BYTES);
+		rowmask[row/8] |= (uint8_t)(1 << (row%8));
+	}
+
+	nextRow = (nextRow + rowsPerFrame) % FRAME_HEIGHT;
+	inputChanged = false;
+
+	n += streamgen_putFullFrame(buf + n, (uint32_t)(t * 1000), frame, rowmask);
+
+	if ( !sendAll(buf, n) )
+		return false;
+
+	++framesSent;
+	++frameNum;
+
+	if ( (audioFlags & STREAM_AUDIO_FLAG_ENABLED) == 0 || sampleRate == 0 || fps == 0 )
+		return true;
+
+	unsigned int bytesPerSample = (audioFlags & STREAM_AUDIO_FLAG_STEREO) ? 4 : 2;
+	unsigned int audioBytes = sampleRate / fps * bytesPerSample;
+
+	for ( unsigned int a = 0; a < audioBytes; a += AUDIO_MESSAGE_SIZE )
+	{
+		static uint8_t abuf[sizeof(MessageHeader) + AUDIO_MESSAGE_SIZE];
+		unsigned int len = audioBytes - a < AUDIO_MESSAGE_SIZE ? audioBytes - a : AUDIO_MESSAGE_SIZE;
+
+		if ( !sendAll(abuf, streamgen_putAudioFrame(abuf, audio, len & ~3u)) )
+			return false;
+	}
+
+	return true;
+}
+
+static int openPty()
+{
+	int fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+
+	if ( fd == -1 || grantpt(fd) != 0 || unlockpt(fd) != 0 )
+	{
+		printf("couldn't create pty (%i)\n", errno);
+		return -1;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+}
+
+static void usage(const char* name)
+{
+	printf("usage: %s [--fps <n>] [--rows <n>] [--samplerate <hz>] [--seconds <s>] [-- command args...]\n", name);
+	printf("  --fps 0 sends frames as fast as the mirror takes them\n");
+	printf("  --jitter <ms> holds each frame up to that long past its timestamp, like a busy USB bus\n");
+}
+
+int main(int argc, char* argv[])
+{
+	char** command = NULL;
+
+	for ( int i = 1; i < argc; ++i )
+	{
+		if ( strcmp(argv[i], "--fps") == 0 && i+1 < argc )
+			fps = (unsigned int)atoi(argv[++i]);
+		else if ( strcmp(argv[i], "--rows") == 0 && i+1 < argc )
+			rowsPerFrame = (unsigned int)atoi(argv[++i]);
+		else if ( strcmp(argv[i], "--samplerate") == 0 && i+1 < argc )
+			sampleRate = (unsigned int)atoi(argv[++i]);
+		else if ( strcmp(argv[i], "--seconds") == 0 && i+1 < argc )
+			seconds = atof(argv[++i]);
+		else if ( strcmp(argv[i], "--jitter") == 0 && i+1 < argc )
+			jitter = atof(argv[++i]) / 1000;
+		else if ( strcmp(argv[i], "--") == 0 && i+1 < argc )
+		{
+			command = &argv[i+1];
+			break;
+		}
+		else
+		{
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	master = openPty();
+
+	if ( master == -1 )
+		return -1;
+
+	const char* path = ptsname(master);
+
+	// hold the slave open in raw mode so nothing echoes back at us and the
+	// master doesn't see a hangup before the mirror gets there
+	int slave = open(path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	struct termios tty;
+
+	if ( slave == -1 || tcgetattr(slave, &tty) != 0 )
+	{
+		printf("couldn't open %s (%i)\n", path, errno);
+		return -1;
+	}
+
+	cfmakeraw(&tty);
+	tcsetattr(slave, TCSANOW, &tty);
+
+	printf("virtual Playdate on %s\n", path);
+	fflush(stdout);
+
+	pid_t child = -1;
+
+	if ( command != NULL )
+	{
+		int n = 0;
+
+		while ( command[n] != NULL )
+			++n;
+
+		char** args = calloc((size_t)n + 3, sizeof(char*));
+		memcpy(args, command, (size_t)n * sizeof(char*));
+		args[n] = "--device";
+		args[n+1] = (char*)path;
+
+		child = fork();
+
+		if ( child == 0 )
+		{
+			execvp(args[0], args);
+			printf("couldn't run %s (%i)\n", args[0], errno);
+			_exit(127);
+		}
+
+		free(args);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	double start = now_sec();
+	double streamStart = start;
+	double nextFrame = start;
+	double sendAt = start;
+
+	for ( ;; )
+	{
+		double now = now_sec();
+
+		if ( seconds > 0 && now - start > seconds )
+			break;
+
+		if ( child != -1 && waitpid(child, NULL, WNOHANG) == child )
+		{
+			printf("%s exited early\n", command[0]);
+			return -1;
+		}
+
+		int timeout = 100;
+
+		if ( streaming && fps > 0 )
+			timeout = sendAt > now ? (int)((sendAt - now) * 1000) + 1 : 0;
+		else if ( streaming )
+			timeout = 0;
+
+		struct pollfd pfd = { .fd = master, .events = POLLIN };
+		poll(&pfd, 1, timeout);
+		readCommands();
+
+		if ( !streaming )
+		{
+			sendAt = nextFrame = streamStart = now_sec();
+			continue;
+		}
+
+		now = now_sec();
+
+		if ( fps == 0 || now >= sendAt )
+		{
+			// stamped with when it was drawn, not when it went out
+			if ( !sendFrame((fps > 0 ? nextFrame : now) - streamStart) )
+				break;
+
+			nextFrame += fps > 0 ? 1.0 / fps : 0;
+
+			// don't try to catch up after a stall
+			if ( nextFrame < now )
+				nextFrame = now;
+
+			sendAt = nextFrame + jitter * rand() / RAND_MAX;
+		}
+	}
+
+	double elapsed = now_sec() - streamStart;
+
+	// hanging up ends the mirror's session
+	close(slave);
+	close(master);
+
+	printf("sent %u frames, %.1f frames/s, %.2f MB/s\n", framesSent, framesSent / elapsed, (double)bytesSent / elapsed / 1e6);
+	printf("received %u button and %u crank commands, %u pokes\n", buttonCommands, crankCommands, pokes);
+
+	if ( child == -1 )
+		return 0;
+
+	int status = 0;
+	waitpid(child, &status, 0);
+
+	if ( !WIFEXITED(status) || WEXITSTATUS(status) != 0 )
+	{
+		printf("%s failed\n", command[0]);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,117 @@
+//
+//  capture.c
+//  MirrorJr
+//
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "capture.h"
+#include "ringbuffer.h"
+
+#define CAPTURE_BUFFER_SIZE (4 * 1024 * 1024)
+
+static RingBuffer capturebuf;
+static FILE* capturefile = NULL;
+static pthread_t writethread;
+static sem_t dataready;
+static volatile bool capturing = false;
+static unsigned int dropped = 0;
+
+static void* writeCaptureFile(void* ud)
+{
+	while ( capturing || RingBuffer_getBytesAvailable(&capturebuf) > 0 )
+	{
+		unsigned int n = RingBuffer_getOutputAvailableSize(&capturebuf);
+
+		if ( n == 0 )
+		{
+			fflush(capturefile);
+			sem_wait(&dataready);
+			continue;
+		}
+
+		fwrite(RingBuffer_getOutputPointer(&capturebuf), 1, n, capturefile);
+		RingBuffer_moveOutputPointer(&capturebuf, n);
+	}
+
+	return NULL;
+}
+
+bool capture_start(const char* path)
+{
+	if ( capturing )
+		capture_stop();
+
+	capturefile = fopen(path, "wb");
+
+	if ( capturefile == NULL )
+	{
+		printf("couldn't open capture file %s\n", path);
+		return false;
+	}
+
+	fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LEN, capturefile);
+
+	RingBuffer_init(&capturebuf);
+	RingBuffer_setSizeMirrored(&capturebuf, CAPTURE_BUFFER_SIZE, 1);
+	sem_init(&dataready, 0, 0);
+	dropped = 0;
+	capturing = true;
+
+	if ( pthread_create(&writethread, NULL, writeCaptureFile, NULL) != 0 )
+	{
+		printf("couldn't start capture thread\n");
+		capturing = false;
+		fclose(capturefile);
+		capturefile = NULL;
+		return false;
+	}
+
+	printf("capturing serial data to %s\n", path);
+	return true;
+}
+
+void capture_stop()
+{
+	if ( !capturing )
+		return;
+
+	capturing = false;
+	sem_post(&dataready);
+	pthread_join(writethread, NULL);
+
+	fclose(capturefile);
+	capturefile = NULL;
+	sem_destroy(&dataready);
+	RingBuffer_deinit(&capturebuf);
+
+	if ( dropped > 0 )
+		printf("capture dropped %u chunks\n", dropped);
+}
+
+void capture_addData(const uint8_t* buf, unsigned int len)
+{
+	if ( !capturing )
+		return;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	CaptureRecord rec = {
+		.timestamp_ns = (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec,
+		.length = len
+	};
+
+	if ( RingBuffer_getFreeSpace(&capturebuf) < sizeof(rec) + len )
+	{
+		++dropped;
+		return;
+	}
+
+	RingBuffer_addData(&capturebuf, &rec, sizeof(rec));
+	RingBuffer_addData(&capturebuf, buf, len);
+	sem_post(&dataready);
+}
@@ -0,0 +1,32 @@
+//
+//  capture.h
+//  MirrorJr
+//
+//  Raw serial capture. The file starts with CAPTURE_MAGIC, followed by one
+//  CaptureRecord header per chunk read from the serial port, each followed
+//  by the chunk's data.
+//
+
+#ifndef capture_h
+#define capture_h
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CAPTURE_MAGIC "PDMIRCAP"
+#define CAPTURE_MAGIC_LEN 8
+
+typedef struct
+{
+	uint64_t timestamp_ns; // CLOCK_MONOTONIC at the time the chunk was read
+	uint32_t length;
+} __attribute__((packed)) CaptureRecord;
+
+bool capture_start(const char* path);
+void capture_stop();
+
+// called from the serial reader thread, never blocks. If the writer thread
+// falls behind the chunk is dropped and counted.
+void capture_addData(const uint8_t* buf, unsigned int len);
+
+#endif /* capture_h */
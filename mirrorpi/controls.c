@@ -9,8 +9,12 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <string.h>
+#include <fcntl.h>
+#include <termios.h>
 #include "controls.h"
 #include "stream.h"
+#include "events.h"
 
 #if TARGET_RPI
 #include <pigpio.h>
@@ -30,9 +34,41 @@ enum buttons
 	kButtonMenu
 };
 
+#if TARGET_RPI
 int pi = 0;
 const unsigned int gpios[] = { 4, 27, 22, 23, 24, 25, 5 };
-unsigned int crank = 0;
+int crank = -1;
+
+// pigpio calls this from its own thread on every edge, main loop does the actual scan
+static void gpioChanged(int gpio, int level, uint32_t tick, void* userdata)
+{
+	events_signal(kEventControls);
+}
+
+// we open the crank port ourselves instead of using pigpio's serOpen() so it's a plain fd the
+// main loop can wait on
+static int openCrankPort(const char* path)
+{
+	int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	
+	if ( fd == -1 )
+		return -1;
+	
+	struct termios tty;
+	
+	if ( tcgetattr(fd, &tty) == 0 )
+	{
+		cfmakeraw(&tty);
+		cfsetispeed(&tty, B115200);
+		cfsetospeed(&tty, B115200);
+		tty.c_cflag |= CLOCAL | CREAD;
+		tty.c_cc[VMIN] = 0;
+		tty.c_cc[VTIME] = 0;
+		tcsetattr(fd, TCSANOW, &tty);
+	}
+	
+	return fd;
+}
 
 bool controls_init()
 {
@@ -44,15 +80,11 @@ bool controls_init()
 		return false;
 	}
 
-	int dev;
-	
-	if ( (dev = serOpen("/dev/ttyS0", 115200, 0)) < 0 )
+	if ( (crank = openCrankPort("/dev/ttyS0")) < 0 )
 	{
 		printf("crank init failed\n");
 		return false;
 	}
-		
-	crank = (unsigned)dev;
 	
 	if ( gpioSetMode(4, PI_INPUT) < 0 || gpioSetPullUpDown(4, PI_PUD_UP) ||
 		 gpioSetMode(27, PI_INPUT) < 0 || gpioSetPullUpDown(27, PI_PUD_UP) ||
@@ -66,6 +98,21 @@ bool controls_init()
 		return false;
 	}
 
+	for ( int i = 0; i < 7; ++i )
+	{
+		if ( gpioSetAlertFuncEx(gpios[i], gpioChanged, NULL) != 0 )
+		{
+			printf("gpioSetAlertFuncEx failed\n");
+			return false;
+		}
+	}
+	
+	if ( !events_watch(crank, kEventControls) )
+	{
+		printf("couldn't watch crank port\n");
+		return false;
+	}
+
 	return true;
 }
 
@@ -92,32 +139,32 @@ void controls_scan()
 	static float lastangle = -1;
 	float crankangle = -1;
 	
-	// rate limit the crank
-	static int limit = 0;
+	// we only get here when something changed, and everything the crank has sent since last
+	// time is read in one go, so the old every-third-scan rate limit isn't needed any more
+	uint8_t buf[64];
+	ssize_t n;
 	
-	if ( ++limit < 3 )
-		return;
-	
-	limit = 0;
-
-	while ( serDataAvailable(crank) )
+	while ( (n = read(crank, buf, sizeof(buf))) > 0 )
 	{
-		int b = serReadByte(crank);
-		
-		if ( b == '\n' )
+		for ( ssize_t i = 0; i < n; ++i )
 		{
-			if ( isdigit(readbuf[0]) )
-				crankangle = atof(readbuf);
-			else if ( readpos == 4 && strncmp(readbuf, "out", 3) == 0 )
-				stream_sendCrankDocked(true);
-			else if ( readpos == 3 && strncmp(readbuf, "in", 2) == 0 )
-				stream_sendCrankDocked(false);
-
-			//printf("read %f", crankangle);
-			readpos = 0;
+			int b = buf[i];
+			
+			if ( b == '\n' )
+			{
+				if ( isdigit(readbuf[0]) )
+					crankangle = atof(readbuf);
+				else if ( readpos == 4 && strncmp(readbuf, "out", 3) == 0 )
+					stream_sendCrankDocked(true);
+				else if ( readpos == 3 && strncmp(readbuf, "in", 2) == 0 )
+					stream_sendCrankDocked(false);
+
+				//printf("read %f", crankangle);
+				readpos = 0;
+			}
+			else if ( readpos < 5 )
+				readbuf[readpos++] = (char)b;
 		}
-		else if ( readpos < 5 )
-			readbuf[readpos++] = b;
 	}
 	
 	if ( crankangle != -1 )
@@ -138,3 +185,14 @@ void controls_scan()
 		lastangle = crankangle;
 	}
 }
+#else
+// no GPIOs or crank off the Pi, so a dev box can still run mirror (e.g. --replay)
+bool controls_init()
+{
+	return true;
+}
+
+void controls_scan()
+{
+}
+#endif
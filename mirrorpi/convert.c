@@ -0,0 +1,322 @@
+//
+//  convert.c
+//  MirrorJr
+//
+
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(TARGET_RPI) && defined(__arm__) && __ARM_ARCH >= 7
+#warning "no NEON, the converters fall back to tables: needs -march=armv7-a -mfpu=neon-vfpv4"
+#endif
+
+#include "convert.h"
+#include "constants.h"
+
+const char* convert_simd()
+{
+#if defined(__ARM_NEON)
+	return "neon";
+#elif defined(__SSE2__)
+	return "sse2";
+#else
+	return "none";
+#endif
+}
+
+static inline uint32_t* nextRow(uint32_t* row, unsigned int pitch)
+{
+	return (uint32_t*)((uint8_t*)row + pitch);
+}
+
+// Each input byte is 8 pixels, MSB first. NEON and SSE2 build a lane mask from
+// the byte's bits and select between the two colors; everything else looks up
+// all 8 pixels at once in a table built from the current palette.
+
+#if defined(__ARM_NEON)
+
+static inline void expandByte(uint8_t bits, uint32_t* out, uint32x4_t c0, uint32x4_t c1)
+{
+	static const uint32_t lo[4] = { 0x80, 0x40, 0x20, 0x10 };
+	static const uint32_t hi[4] = { 0x08, 0x04, 0x02, 0x01 };
+	uint32x4_t b = vdupq_n_u32(bits);
+
+	vst1q_u32(out, vbslq_u32(vtstq_u32(b, vld1q_u32(lo)), c1, c0));
+	vst1q_u32(out + 4, vbslq_u32(vtstq_u32(b, vld1q_u32(hi)), c1, c0));
+}
+
+void convertTo32Bit_1bit(const uint8_t* in, uint32_t* out, unsigned int pitch, const uint32_t palette[2], unsigned int firstRow, unsigned int numRows)
+{
+	uint32x4_t c0 = vdupq_n_u32(palette[0]);
+	uint32x4_t c1 = vdupq_n_u32(palette[1]);
+
+	in += firstRow * ROW_SIZE_BYTES;
+
+	for ( unsigned int y = 0; y < numRows; ++y, in += ROW_SIZE_BYTES, out = nextRow(out, pitch) )
+		for ( unsigned int x = 0; x < ROW_SIZE_BYTES; ++x )
+			expandByte(in[x], out + x * 8, c0, c1);
+}
+
+#elif defined(__SSE2__)
+
+void convertTo32Bit_1bit(const uint8_t* in, uint32_t* out, unsigned int pitch, const uint32_t palette[2], unsigned int firstRow, unsigned int numRows)
+{
+	const __m128i lo = _mm_set_epi32(0x10, 0x20, 0x40, 0x80);
+	const __m128i hi = _mm_set_epi32(0x01, 0x02, 0x04, 0x08);
+	const __m128i c0 = _mm_set1_epi32((int)palette[0]);
+	const __m128i diff = _mm_xor_si128(c0, _mm_set1_epi32((int)palette[1]));
+
+	in += firstRow * ROW_SIZE_BYTES;
+
+	for ( unsigned int y = 0; y < numRows; ++y, in += ROW_SIZE_BYTES, out = nextRow(out, pitch) )
+	{
+		for ( unsigned int x = 0; x < ROW_SIZE_BYTES; ++x )
+		{
+			__m128i b = _mm_set1_epi32(in[x]);
+
+			// c0 ^ ((c0 ^ c1) & mask) picks c1 where the bit is set
+			__m128i m0 = _mm_cmpeq_epi32(_mm_and_si128(b, lo), lo);
+			__m128i m1 = _mm_cmpeq_epi32(_mm_and_si128(b, hi), hi);
+
+			_mm_storeu_si128((__m128i*)(out + x * 8), _mm_xor_si128(c0, _mm_and_si128(diff, m0)));
+			_mm_storeu_si128((__m128i*)(out + x * 8 + 4), _mm_xor_si128(c0, _mm_and_si128(diff, m1)));
+		}
+	}
+}
+
+#else
+
+static uint32_t lut[256][8];
+static uint32_t lutColors[2];
+static bool lutValid = false;
+
+void convertPrepare_1bit(const uint32_t palette[2])
+{
+	// rebuilt the first time we see a new palette, which is rare
+	if ( lutValid && lutColors[0] == palette[0] && lutColors[1] == palette[1] )
+		return;
+
+	for ( int b = 0; b < 256; ++b )
+		for ( int bit = 0; bit < 8; ++bit )
+			lut[b][bit] = (b & (0x80 >> bit)) ? palette[1] : palette[0];
+
+	lutColors[0] = palette[0];
+	lutColors[1] = palette[1];
+	lutValid = true;
+}
+
+void convertTo32Bit_1bit(const uint8_t* in, uint32_t* out, unsigned int pitch, const uint32_t palette[2], unsigned int firstRow, unsigned int numRows)
+{
+	convertPrepare_1bit(palette);
+
+	in += firstRow * ROW_SIZE_BYTES;
+
+	for ( unsigned int y = 0; y < numRows; ++y, in += ROW_SIZE_BYTES, out = nextRow(out, pitch) )
+		for ( unsigned int x = 0; x < ROW_SIZE_BYTES; ++x )
+			memcpy(out + x * 8, lut[in[x]], sizeof(lut[0]));
+}
+
+#endif
+
+#if defined(__ARM_NEON) || defined(__SSE2__)
+void convertPrepare_1bit(const uint32_t palette[2])
+{
+	// the SIMD paths select between the two colors directly, no table
+}
+#endif
+
+// A byte from each of the two rows holds four 2x2 blocks. The tables turn each
+// byte into its half of the four palette indices, one per byte of the result,
+// so a single OR decodes the pair. They're constant so bands can share them.
+#define INDEX(b, s) ((((b) >> 6) & 3u) << (s) | (((b) >> 4) & 3u) << (8 + (s)) | (((b) >> 2) & 3u) << (16 + (s)) | ((b) & 3u) << (24 + (s)))
+#define INDEX4(b, s) INDEX(b, s), INDEX(b + 1, s), INDEX(b + 2, s), INDEX(b + 3, s)
+#define INDEX16(b, s) INDEX4(b, s), INDEX4(b + 4, s), INDEX4(b + 8, s), INDEX4(b + 12, s)
+#define INDEX64(b, s) INDEX16(b, s), INDEX16(b + 16, s), INDEX16(b + 32, s), INDEX16(b + 48, s)
+#define INDEX256(s) INDEX64(0, s), INDEX64(64, s), INDEX64(128, s), INDEX64(192, s)
+
+static const uint32_t topIndex[256] = { INDEX256(2) };
+static const uint32_t bottomIndex[256] = { INDEX256(0) };
+
+// writes 4 colors as 2x2 blocks: c0 c0 c1 c1 c2 c2 c3 c3 to out and the row below it
+// (built from registers: storing the colors to an array and loading them back stalls store forwarding)
+static inline void store2x2(uint32_t* out, uint32_t* below, uint32_t c0, uint32_t c1, uint32_t c2, uint32_t c3)
+{
+#if defined(__ARM_NEON)
+	uint32x4_t v = vcombine_u32(vcreate_u32((uint64_t)c0 | ((uint64_t)c1 << 32)), vcreate_u32((uint64_t)c2 | ((uint64_t)c3 << 32)));
+	uint32x4x2_t pair = { { v, v } };
+	vst2q_u32(out, pair);
+	vst2q_u32(below, pair);
+#elif defined(__SSE2__)
+	__m128i v = _mm_set_epi32((int)c3, (int)c2, (int)c1, (int)c0);
+	__m128i lo = _mm_unpacklo_epi32(v, v);
+	__m128i hi = _mm_unpackhi_epi32(v, v);
+	_mm_storeu_si128((__m128i*)out, lo);
+	_mm_storeu_si128((__m128i*)(out + 4), hi);
+	_mm_storeu_si128((__m128i*)below, lo);
+	_mm_storeu_si128((__m128i*)(below + 4), hi);
+#else
+	const uint32_t c[4] = { c0, c1, c2, c3 };
+
+	for ( int j = 0; j < 4; ++j )
+	{
+		uint64_t two = (uint64_t)c[j] | ((uint64_t)c[j] << 32);
+		memcpy(out + 2 * j, &two, sizeof(two));
+		memcpy(below + 2 * j, &two, sizeof(two));
+	}
+#endif
+}
+
+void convertTo32Bit_4bit_2x2(const uint8_t* in, uint32_t* out, unsigned int pitch, const uint32_t palette[16], unsigned int firstRow, unsigned int numRows)
+{
+	for ( unsigned int y = firstRow; y < firstRow + numRows; y += 2 )
+	{
+		const uint8_t* top = in + y * ROW_SIZE_BYTES;
+		const uint8_t* bottom = top + ROW_SIZE_BYTES;
+		uint32_t* row = out;
+		uint32_t* below = nextRow(out, pitch);
+
+		out = nextRow(below, pitch);
+
+		for ( unsigned int x = 0; x < ROW_SIZE_BYTES; ++x )
+		{
+			uint32_t idx = topIndex[top[x]] | bottomIndex[bottom[x]];
+			store2x2(row + x * 8, below + x * 8, palette[idx & 0xff], palette[(idx >> 8) & 0xff], palette[(idx >> 16) & 0xff], palette[idx >> 24]);
+		}
+	}
+}
+
+// 8 bits per pixel for the indexed output, 8 pixels per table entry like the 32-bit fallback
+static uint64_t lut8[256];
+static uint8_t lut8Values[2];
+static bool lut8Valid = false;
+
+void convertTo8Bit_1bit(const uint8_t* in, uint8_t* out, unsigned int pitch, const uint8_t values[2], unsigned int firstRow, unsigned int numRows)
+{
+	if ( !lut8Valid || lut8Values[0] != values[0] || lut8Values[1] != values[1] )
+	{
+		for ( unsigned int b = 0; b < 256; ++b )
+		{
+			uint8_t px[8];
+
+			for ( unsigned int bit = 0; bit < 8; ++bit )
+				px[bit] = (b & (0x80 >> bit)) ? values[1] : values[0];
+
+			memcpy(&lut8[b], px, sizeof(px));
+		}
+
+		lut8Values[0] = values[0];
+		lut8Values[1] = values[1];
+		lut8Valid = true;
+	}
+
+	in += firstRow * ROW_SIZE_BYTES;
+
+	for ( unsigned int y = 0; y < numRows; ++y, in += ROW_SIZE_BYTES, out += pitch )
+		for ( unsigned int x = 0; x < ROW_SIZE_BYTES; ++x )
+			memcpy(out + x * 8, &lut8[in[x]], 8);
+}
+
+void convertToYUV_4bit_2x2(const uint8_t* in, uint8_t* y, unsigned int ypitch, uint8_t* u, uint8_t* v, unsigned int uvpitch, const uint8_t yuv[16][3], unsigned int firstRow, unsigned int numRows)
+{
+	for ( unsigned int row = firstRow; row < firstRow + numRows; row += 2 )
+	{
+		const uint8_t* top = in + row * ROW_SIZE_BYTES;
+		const uint8_t* bottom = top + ROW_SIZE_BYTES;
+
+		for ( unsigned int x = 0; x < ROW_SIZE_BYTES; ++x )
+		{
+			uint32_t idx = topIndex[top[x]] | bottomIndex[bottom[x]];
+
+			const uint8_t* c0 = yuv[idx & 0xff];
+			const uint8_t* c1 = yuv[(idx >> 8) & 0xff];
+			const uint8_t* c2 = yuv[(idx >> 16) & 0xff];
+			const uint8_t* c3 = yuv[idx >> 24];
+
+			// a 2x2 block is one chroma sample, which is what makes 4-bit mode a perfect fit for IYUV
+			uint64_t luma = (uint64_t)(c0[0] | (c1[0] << 16)) * 0x0101 | (uint64_t)(c2[0] | (c3[0] << 16)) * 0x0101 << 32;
+			uint32_t cb = (uint32_t)(c0[1] | (c1[1] << 8) | (c2[1] << 16)) | (uint32_t)c3[1] << 24;
+			uint32_t cr = (uint32_t)(c0[2] | (c1[2] << 8) | (c2[2] << 16)) | (uint32_t)c3[2] << 24;
+
+			memcpy(y + x * 8, &luma, sizeof(luma));
+			memcpy(y + ypitch + x * 8, &luma, sizeof(luma));
+			memcpy(u + x * 4, &cb, sizeof(cb));
+			memcpy(v + x * 4, &cr, sizeof(cr));
+		}
+
+		y += 2 * ypitch;
+		u += uvpitch;
+		v += uvpitch;
+	}
+}
+
+static uint8_t clampByte(float f)
+{
+	return f <= 0 ? 0 : f >= 255 ? 255 : (uint8_t)(f + 0.5f);
+}
+
+void convertPaletteToYUV(const uint32_t* palette, uint8_t yuv[][3], unsigned int count)
+{
+	// full range BT.601, what SDL_YUV_CONVERSION_JPEG converts back with
+	for ( unsigned int i = 0; i < count; ++i )
+	{
+		float r = (palette[i] >> 16) & 0xff;
+		float g = (palette[i] >> 8) & 0xff;
+		float b = palette[i] & 0xff;
+
+		yuv[i][0] = clampByte(0.299f * r + 0.587f * g + 0.114f * b);
+		yuv[i][1] = clampByte(128 - 0.168736f * r - 0.331264f * g + 0.5f * b);
+		yuv[i][2] = clampByte(128 + 0.5f * r - 0.418688f * g - 0.081312f * b);
+	}
+}
+
+// each pixel three times across; convertScale32 copies the row down
+static inline void widen3(const uint32_t* in, uint32_t* out, unsigned int width)
+{
+	unsigned int x = 0;
+
+#if defined(__ARM_NEON)
+	for ( ; x + 4 <= width; x += 4 )
+	{
+		uint32x4_t v = vld1q_u32(in + x);
+		uint32x4x3_t three = { { v, v, v } };
+		vst3q_u32(out + x * 3, three);
+	}
+#elif defined(__SSE2__)
+	for ( ; x + 4 <= width; x += 4 )
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(in + x));
+		_mm_storeu_si128((__m128i*)(out + x * 3), _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 0, 0)));
+		_mm_storeu_si128((__m128i*)(out + x * 3 + 4), _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 2, 1, 1)));
+		_mm_storeu_si128((__m128i*)(out + x * 3 + 8), _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 2)));
+	}
+#endif
+
+	for ( ; x < width; ++x )
+		out[x * 3] = out[x * 3 + 1] = out[x * 3 + 2] = in[x];
+}
+
+void convertScale32(const uint32_t* in, unsigned int inPitch, uint32_t* out, unsigned int pitch, unsigned int width, unsigned int numRows, unsigned int scale)
+{
+	for ( unsigned int y = 0; y < numRows; ++y, in = (const uint32_t*)((const uint8_t*)in + inPitch) )
+	{
+		uint32_t* first = out;
+
+		if ( scale == 3 )
+			widen3(in, out, width);
+		else
+		{
+			for ( unsigned int x = 0; x < width; ++x )
+				for ( unsigned int i = 0; i < scale; ++i )
+					out[x * scale + i] = in[x];
+		}
+
+		out = nextRow(out, pitch);
+
+		for ( unsigned int i = 1; i < scale; ++i, out = nextRow(out, pitch) )
+			memcpy(out, first, width * scale * sizeof(uint32_t));
+	}
+}
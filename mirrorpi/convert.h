@@ -0,0 +1,41 @@
+//
+//  convert.h
+//  MirrorJr
+//
+//  Framebuffer to display pixel conversion. Input is FRAME_WIDTH x FRAME_HEIGHT
+//  with ROW_SIZE_BYTES bytes per row. Rows firstRow to firstRow+numRows-1 are
+//  converted to 32-bit pixels written starting at out, pitch bytes apart, so
+//  out can be a locked texture rect covering just those rows.
+//
+
+#ifndef convert_h
+#define convert_h
+
+#include <stdint.h>
+
+// "neon", "sse2" or "none": which kernels this build picked
+const char* convert_simd();
+
+// The portable 1-bit path keeps a table per palette, built on first use.
+// Converting bands of a frame on several threads, call this first, on one.
+void convertPrepare_1bit(const uint32_t palette[2]);
+
+void convertTo32Bit_1bit(const uint8_t* in, uint32_t* out, unsigned int pitch, const uint32_t palette[2], unsigned int firstRow, unsigned int numRows);
+
+// 4-bit mode packs a 2x2 block of bits into a palette index, drawn 2x2 instead of switching resolution.
+// firstRow and numRows have to be even.
+void convertTo32Bit_4bit_2x2(const uint8_t* in, uint32_t* out, unsigned int pitch, const uint32_t palette[16], unsigned int firstRow, unsigned int numRows);
+
+// Indexed output: one byte per pixel instead of four. 1-bit frames become
+// values[0]/values[1] per pixel. 4-bit frames go to IYUV planes, one chroma
+// sample per 2x2 block, from a palette run through convertPaletteToYUV().
+// u and v point at chroma row firstRow/2.
+void convertTo8Bit_1bit(const uint8_t* in, uint8_t* out, unsigned int pitch, const uint8_t values[2], unsigned int firstRow, unsigned int numRows);
+void convertToYUV_4bit_2x2(const uint8_t* in, uint8_t* y, unsigned int ypitch, uint8_t* u, uint8_t* v, unsigned int uvpitch, const uint8_t yuv[16][3], unsigned int firstRow, unsigned int numRows);
+void convertPaletteToYUV(const uint32_t* palette, uint8_t yuv[][3], unsigned int count);
+
+// Nearest neighbor upscale of numRows rows of 32-bit pixels, each pixel
+// becoming a scale x scale block. 3x has a SIMD path, the Pi's 1280x720 case.
+void convertScale32(const uint32_t* in, unsigned int inPitch, uint32_t* out, unsigned int pitch, unsigned int width, unsigned int numRows, unsigned int scale);
+
+#endif /* convert_h */
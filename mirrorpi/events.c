@@ -0,0 +1,251 @@
+//
+//  events.c
+//  MirrorJr
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "events.h"
+
+#define MAX_WATCHES 8
+
+static _Atomic unsigned int signalled = 0;
+
+#if defined(__linux__)
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+static int epfd = -1;
+static int wakefd = -1;
+static int timerfd = -1;
+static unsigned int timerevent = 0;
+
+// epoll_event.data holds the event bits for a watched fd; these two are ours
+#define WAKE_TAG (1u << 31)
+#define TIMER_TAG (1u << 30)
+
+static bool addFd(int fd, uint32_t events, uint32_t tag)
+{
+	struct epoll_event ev = { .events = events, .data.u32 = tag };
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+bool events_init()
+{
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+
+	if ( epfd == -1 || wakefd == -1 || timerfd == -1 || !addFd(wakefd, EPOLLIN, WAKE_TAG) || !addFd(timerfd, EPOLLIN, TIMER_TAG) )
+	{
+		printf("couldn't set up event loop (%i)\n", errno);
+		return false;
+	}
+
+	return true;
+}
+
+bool events_watch(int fd, unsigned int event)
+{
+	return addFd(fd, EPOLLIN, event);
+}
+
+bool events_watchWritable(int fd, unsigned int event)
+{
+	return addFd(fd, EPOLLOUT, event);
+}
+
+void events_unwatch(int fd)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+void events_signal(unsigned int event)
+{
+	uint64_t one = 1;
+
+	// only the first signal since the last wait needs to poke the eventfd
+	if ( atomic_fetch_or(&signalled, event) == 0 )
+		write(wakefd, &one, sizeof(one));
+}
+
+bool events_startTimer(unsigned int event, unsigned int interval_ms)
+{
+	struct itimerspec spec = {
+		.it_interval = { interval_ms / 1000, (long)(interval_ms % 1000) * 1000000 },
+		.it_value = { 0, 1 },
+	};
+
+	timerevent = event;
+	return timerfd_settime(timerfd, 0, &spec, NULL) == 0;
+}
+
+void events_stopTimer(unsigned int event)
+{
+	struct itimerspec spec = {{0}};
+
+	if ( event == timerevent )
+		timerfd_settime(timerfd, 0, &spec, NULL);
+}
+
+unsigned int events_wait(int timeout_ms)
+{
+	struct epoll_event evs[MAX_WATCHES];
+	unsigned int fired = 0;
+	int n = epoll_wait(epfd, evs, MAX_WATCHES, timeout_ms);
+
+	for ( int i = 0; i < n; ++i )
+	{
+		uint64_t count;
+
+		if ( evs[i].data.u32 == WAKE_TAG )
+			read(wakefd, &count, sizeof(count));
+		else if ( evs[i].data.u32 == TIMER_TAG )
+		{
+			if ( read(timerfd, &count, sizeof(count)) > 0 )
+				fired |= timerevent;
+		}
+		else
+			fired |= evs[i].data.u32;
+	}
+
+	return fired | atomic_exchange(&signalled, 0);
+}
+
+#else
+
+// no epoll: poll() on a self-pipe plus the watched fds, and the timer is a deadline
+
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+
+static int wakepipe[2] = { -1, -1 };
+static struct pollfd watches[MAX_WATCHES + 1];
+static unsigned int watchevents[MAX_WATCHES + 1];
+static int numwatches = 0;
+static unsigned int timerevent = 0;
+static unsigned int timerinterval = 0;
+static int64_t timerdue = 0;
+
+static int64_t now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+bool events_init()
+{
+	if ( pipe(wakepipe) != 0 )
+		return false;
+
+	fcntl(wakepipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(wakepipe[1], F_SETFL, O_NONBLOCK);
+
+	watches[0] = (struct pollfd){ .fd = wakepipe[0], .events = POLLIN };
+	numwatches = 1;
+	return true;
+}
+
+static bool addWatch(int fd, short events, unsigned int event)
+{
+	if ( numwatches > MAX_WATCHES )
+		return false;
+
+	watches[numwatches] = (struct pollfd){ .fd = fd, .events = events };
+	watchevents[numwatches++] = event;
+	return true;
+}
+
+bool events_watch(int fd, unsigned int event)
+{
+	return addWatch(fd, POLLIN, event);
+}
+
+bool events_watchWritable(int fd, unsigned int event)
+{
+	return addWatch(fd, POLLOUT, event);
+}
+
+void events_unwatch(int fd)
+{
+	for ( int i = 1; i < numwatches; ++i )
+	{
+		if ( watches[i].fd == fd )
+		{
+			watches[i] = watches[--numwatches];
+			watchevents[i] = watchevents[numwatches];
+			return;
+		}
+	}
+}
+
+void events_signal(unsigned int event)
+{
+	uint8_t b = 0;
+
+	if ( atomic_fetch_or(&signalled, event) == 0 )
+		write(wakepipe[1], &b, 1);
+}
+
+bool events_startTimer(unsigned int event, unsigned int interval_ms)
+{
+	timerevent = event;
+	timerinterval = interval_ms;
+	timerdue = now_ms();
+	return true;
+}
+
+void events_stopTimer(unsigned int event)
+{
+	if ( event == timerevent )
+		timerinterval = 0;
+}
+
+unsigned int events_wait(int timeout_ms)
+{
+	unsigned int fired = 0;
+
+	if ( timerinterval > 0 )
+	{
+		int64_t wait = timerdue - now_ms();
+
+		if ( wait < 0 )
+			wait = 0;
+
+		if ( timeout_ms < 0 || wait < timeout_ms )
+			timeout_ms = (int)wait;
+	}
+
+	if ( poll(watches, (nfds_t)numwatches, timeout_ms) > 0 )
+	{
+		uint8_t buf[16];
+
+		if ( watches[0].revents & POLLIN )
+			while ( read(wakepipe[0], buf, sizeof(buf)) > 0 )
+				;
+
+		for ( int i = 1; i < numwatches; ++i )
+		{
+			if ( watches[i].revents & (POLLIN | POLLOUT) )
+				fired |= watchevents[i];
+		}
+	}
+
+	if ( timerinterval > 0 && now_ms() >= timerdue )
+	{
+		fired |= timerevent;
+		timerdue = now_ms() + timerinterval;
+	}
+
+	return fired | atomic_exchange(&signalled, 0);
+}
+
+#endif
@@ -0,0 +1,41 @@
+//
+//  events.h
+//  MirrorJr
+//
+//  Main loop wakeups. Sources are file descriptors (crank serial port),
+//  signals from other threads (serial reader, GPIO callbacks) and timers,
+//  and events_wait() sleeps until one of them has something for us.
+//
+
+#ifndef events_h
+#define events_h
+
+#include <stdbool.h>
+
+enum
+{
+	kEventSerialData = (1 << 0), // serial reader added data to the stream ring
+	kEventControls = (1 << 1), // button edge or crank data
+	kEventPokeTimer = (1 << 2), // time to let the device know we're still here
+	kEventSerialWritable = (1 << 3), // outbound queue can write again
+	kEventHotplug = (1 << 4), // a tty came or went
+};
+
+bool events_init();
+
+// fd becoming readable raises event
+bool events_watch(int fd, unsigned int event);
+bool events_watchWritable(int fd, unsigned int event);
+void events_unwatch(int fd);
+
+// safe to call from any thread
+void events_signal(unsigned int event);
+
+// raises event every interval_ms, the first time right away
+bool events_startTimer(unsigned int event, unsigned int interval_ms);
+void events_stopTimer(unsigned int event);
+
+// returns the events that fired, or 0 if timeout_ms passed first
+unsigned int events_wait(int timeout_ms);
+
+#endif /* events_h */
@@ -5,178 +5,414 @@
 //  Created by Dave Hayden on 9/25/24.
 //
 
-#include <assert.h>
+#include <stdio.h>
+#include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "frame.h"
 #include "constants.h"
+#include "output.h"
+#include "pacing.h"
+#include "inputtest.h"
 
 //#define LOG printf
 #define LOG(s)
 
-SDL_Renderer* renderer;
-SDL_Texture* sdl_texture = NULL;
-uint8_t* framebuffer1bit;
-unsigned int* framebuffer32bit; // ARGB data
-
 #define DISPLAY_BLACK 0xff000000
 #define DISPLAY_WHITE 0xffb1afa8
 
-enum FrameMode
+// a frame on its way to the display
+typedef struct
 {
-	kFrame1bit,
-	kFrame4bit_2x2,
-} mode = kFrame1bit;
-
-uint32_t palette[16] = {
-	DISPLAY_BLACK, DISPLAY_WHITE
-};
-
-int render_w = LCD_COLUMNS;
-int render_h = LCD_ROWS;
-
-bool frame_init(SDL_Window* window)
+	OutputFrame f;
+	uint64_t due_us; // pacing_now() time to show it, 0 for right away
+	uint64_t deviceTime_us; // from pacing_frameDue(), UINT64_MAX without a timestamp
+	uint32_t inputTag; // from inputtest_frameEnd(), 0 for none
+} FrameSlot;
+
+// Frames waiting for their due time, the jitter buffer. If it fills up, or
+// the renderer falls behind and several are due at once, only the newest
+// gets shown and the ones it replaces are dropped.
+#define FRAME_QUEUE 6
+
+// one being filled, the queue, and the one on screen
+#define FRAME_SLOTS (FRAME_QUEUE + 2)
+
+static FrameSlot slots[FRAME_SLOTS];
+static FrameSlot* freeSlots[FRAME_SLOTS];
+static unsigned int numFree = 0;
+static FrameSlot* queue[FRAME_QUEUE]; // oldest first
+static unsigned int queued = 0;
+static FrameSlot* writing = NULL;
+static FrameSlot* presenting = NULL;
+static FrameStats stats;
+
+// the output gets a thread of its own unless it says it can't have one (see
+// output_sdlCanThread()), then frames go up from frame_present() instead
+static bool renderThread = false;
+
+static pthread_mutex_t slotLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t frameReady = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t framePresented = PTHREAD_COND_INITIALIZER;
+
+// set from outside, under slotLock
+static bool indexedEnabled = false;
+
+static const OutputBackend* output = NULL;
+
+// the frame after old has to cover the rows old changed, since old never made it to the screen
+static void dropFrame(FrameSlot* old, FrameSlot* next)
 {
-	renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-
-	if ( renderer == NULL )
-	{
-		printf("couldn't create renderer: %s\n", SDL_GetError());
-		return 4;
-	}
+	for ( unsigned int i = 0; i < sizeof(next->f.dirtyRows); ++i )
+		next->f.dirtyRows[i] |= old->f.dirtyRows[i];
+	
+	next->f.allDirty |= old->f.allDirty;
+	
+	// tags only go up, the newer one's the one that counts
+	if ( old->inputTag > next->inputTag )
+		next->inputTag = old->inputTag;
+	
+	freeSlots[numFree++] = old;
+	++stats.skipped;
+	inputtest_frameSkipped();
+}
 
-	SDL_RendererInfo info;
+// index of the newest queued frame that's due, or queued if none is yet
+static unsigned int newestDue(uint64_t now)
+{
+	unsigned int pick = queued;
 	
-	if ( SDL_GetRendererInfo(renderer, &info) != 0 )
+	for ( unsigned int i = 0; i < queued; ++i )
 	{
-		printf("SDL_GetRendererInfo failed: %s", SDL_GetError());
-		return false;
+		if ( queue[i]->due_us <= now )
+			pick = i;
 	}
+	
+	return pick;
+}
 
-	if ( SDL_InitSubSystem(SDL_INIT_VIDEO) != 0 )
+// With wait, blocks until a frame is due, otherwise shows the newest frame
+// regardless of its due time. Returns false if there was nothing to show.
+static bool renderNext(bool wait)
+{
+	pthread_mutex_lock(&slotLock);
+	
+	unsigned int pick;
+	
+	for ( ;; )
 	{
-		printf("video init failed: %s", SDL_GetError());
-		return false;
+		if ( queued == 0 )
+		{
+			if ( !wait )
+			{
+				pthread_mutex_unlock(&slotLock);
+				return false;
+			}
+			
+			pthread_cond_wait(&frameReady, &slotLock);
+			continue;
+		}
+		
+		if ( !wait )
+		{
+			pick = queued - 1;
+			break;
+		}
+		
+		pick = newestDue(pacing_now());
+		
+		if ( pick < queued )
+			break;
+		
+		// sleep until the next one's due, or something new shows up
+		uint64_t due = UINT64_MAX;
+		
+		for ( unsigned int i = 0; i < queued; ++i )
+		{
+			if ( queue[i]->due_us < due )
+				due = queue[i]->due_us;
+		}
+		
+		struct timespec ts = { .tv_sec = (time_t)(due / 1000000), .tv_nsec = (long)(due % 1000000) * 1000 };
+		pthread_cond_timedwait(&frameReady, &slotLock, &ts);
 	}
 	
-	framebuffer32bit = calloc(1, LCD_ROWS * LCD_COLUMNS * 4);
-	framebuffer1bit = calloc(1, LCD_ROWSIZE * LCD_COLUMNS);
-
-	assert(sdl_texture == NULL);
-
-	sdl_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, render_w, render_h);
-	assert(sdl_texture);
-	SDL_SetTextureBlendMode(sdl_texture, SDL_BLENDMODE_BLEND);
+	for ( unsigned int i = 0; i < pick; ++i )
+		dropFrame(queue[i], queue[i+1]);
+	
+	FrameSlot* s = queue[pick];
+	queued -= pick + 1;
+	memmove(queue, queue + pick + 1, queued * sizeof(FrameSlot*));
+	
+	// the texture has what the old one had, nothing needs it anymore
+	if ( presenting != NULL )
+		freeSlots[numFree++] = presenting;
+	
+	presenting = s;
+	bool indexed = indexedEnabled;
+	pthread_mutex_unlock(&slotLock);
+	
+	struct timespec cpu0, cpu1;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu0);
+	
+	output->present(&s->f, indexed);
+	memset(s->f.dirtyRows, 0, sizeof(s->f.dirtyRows));
+	s->f.allDirty = false;
+	
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu1);
+	
+	if ( s->deviceTime_us != UINT64_MAX )
+		pacing_presented(s->deviceTime_us, s->due_us);
+	
+	inputtest_framePresented(s->inputTag);
+	
+	pthread_mutex_lock(&slotLock);
+	++stats.presented;
+	stats.outputCpu_us += (uint64_t)((cpu1.tv_sec - cpu0.tv_sec) * 1000000 + (cpu1.tv_nsec - cpu0.tv_nsec) / 1000);
+	pthread_cond_broadcast(&framePresented);
+	pthread_mutex_unlock(&slotLock);
 	
 	return true;
 }
 
-// input buffer is LCD_COLUMNS x LCD_ROWS with LCD_ROWSIZE bytes per row
-// output buffer is render_w x render_h and render_w * 4 bytes per row
+static pthread_cond_t renderStarted = PTHREAD_COND_INITIALIZER;
+static int renderInitResult = -1;
 
-static void convertTo32Bit_1bit(const uint8_t* in, uint32_t* out)
+static void* renderMain(void* ud)
 {
-	for ( int y = 0; y < LCD_ROWS; ++y )
-	{
-		for ( int x = 0; x < LCD_COLUMNS / 8; ++x )
-		{
-			unsigned char src_bits = in[x + y * LCD_ROWSIZE];
+	bool ok = output->start();
+	
+	pthread_mutex_lock(&slotLock);
+	renderInitResult = ok;
+	pthread_cond_signal(&renderStarted);
+	pthread_mutex_unlock(&slotLock);
+	
+	if ( !ok )
+		return NULL;
+	
+	for ( ;; )
+		renderNext(true);
+	
+	return NULL;
+}
 
-			for ( int bit = 0; bit < 8; bit++ )
-			{
-				unsigned char bitmask = 0x80 >> bit;
-				unsigned int dest_color = (src_bits & bitmask) ? palette[1] : palette[0];
-				int dest_x = (x * 8) + bit;
-				int out_i = dest_x + y * render_w;
-				out[out_i] = dest_color;
-			}
-		}
+bool frame_init(const char* spec)
+{
+	const char* arg;
+	output = output_find(spec, &arg);
+	
+	if ( output == NULL )
+	{
+		printf("no output called %s\n", spec);
+		return false;
 	}
+	
+	if ( !output->open(arg) )
+		return false;
+	
+	for ( int i = 0; i < FRAME_SLOTS; ++i )
+	{
+		slots[i].f.allDirty = true;
+		slots[i].f.mode = kFrame1bit;
+		slots[i].f.palette[0] = DISPLAY_BLACK;
+		slots[i].f.palette[1] = DISPLAY_WHITE;
+		slots[i].deviceTime_us = UINT64_MAX;
+		freeSlots[numFree++] = &slots[i];
+	}
+	
+	writing = freeSlots[--numFree];
+	renderThread = output->canThread == NULL || output->canThread();
+	
+	if ( !renderThread )
+		return output->start();
+	
+	// due times are on the monotonic clock
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&frameReady, &attr);
+	pthread_condattr_destroy(&attr);
+	
+	// the renderer (and its GL context) has to live on the thread that draws with it
+	pthread_t thread;
+	
+	if ( pthread_create(&thread, NULL, renderMain, NULL) != 0 )
+	{
+		printf("couldn't start render thread\n");
+		return false;
+	}
+	
+	pthread_detach(thread);
+	pthread_mutex_lock(&slotLock);
+	
+	while ( renderInitResult == -1 )
+		pthread_cond_wait(&renderStarted, &slotLock);
+	
+	pthread_mutex_unlock(&slotLock);
+	return renderInitResult == 1;
 }
 
-static void convertTo32Bit_4bit_2x2(const uint8_t* in, uint32_t* out)
+bool frame_setIndexed(bool enable)
 {
-	for ( int y = 0; y < LCD_ROWS; y += 2 )
+	if ( enable && !output->canIndex() )
 	{
-		for ( int x = 0; x < LCD_COLUMNS / 8; ++x )
-		{
-			unsigned char src_bits1 = in[x + y * LCD_ROWSIZE];
-			unsigned char src_bits2 = in[x + (y+1) * LCD_ROWSIZE];
-
-			for ( int bit = 0; bit < 8; bit += 2 )
-			{
-				unsigned char bitmask1 = 0x80 >> bit;
-				unsigned char bitmask2 = 0x80 >> (bit+1);
-				
-				unsigned int idx =
-					((src_bits1 & bitmask1) ? 8 : 0) |
-					((src_bits1 & bitmask2) ? 4 : 0) |
-					((src_bits2 & bitmask1) ? 2 : 0) |
-					((src_bits2 & bitmask2) ? 1 : 0);
-				
-				unsigned int dest_color = palette[idx];
-				
-				int dest_x = (x * 8) + bit;
-				int out_i = dest_x + y * render_w;
-
-				// instead of switching resolution, we'll draw 2x2
-				out[out_i] = dest_color;
-				out[out_i+1] = dest_color;
-				out[out_i+render_w] = dest_color;
-				out[out_i+render_w+1] = dest_color;
-			}
-		}
+		printf("%s output can't do indexed frames\n", output->name);
+		return false;
 	}
+	
+	pthread_mutex_lock(&slotLock);
+	indexedEnabled = enable;
+	pthread_mutex_unlock(&slotLock);
+	
+	// so the switch shows up even if the picture doesn't change
+	writing->f.allDirty = true;
+	return true;
 }
 
 void frame_reset()
 {
-	mode = kFrame1bit;
-	palette[0] = DISPLAY_BLACK;
-	palette[1] = DISPLAY_WHITE;
+	writing->f.mode = kFrame1bit;
+	writing->f.palette[0] = DISPLAY_BLACK;
+	writing->f.palette[1] = DISPLAY_WHITE;
+	writing->f.allDirty = true;
+	
+	// a new game's timestamps have nothing to do with the last one's
+	pacing_reset();
 }
 
-void frame_set1BitPalette(RGB rgb[2])
+// resending the palette the screen already has doesn't make the frame any different
+static void setPalette(enum FrameMode mode, const RGB rgb[], int count)
 {
-	mode = kFrame1bit;
+	uint32_t pal[16];
+	
+	for ( int i = 0; i < count; ++i )
+		pal[i] = 0xff000000 | ((uint32_t)rgb[i].r << 16) | ((uint32_t)rgb[i].g << 8) | rgb[i].b;
+	
+	if ( writing->f.mode == mode && memcmp(writing->f.palette, pal, (size_t)count * sizeof(uint32_t)) == 0 )
+		return;
 	
-	for ( int i = 0; i < 2; ++i )
-		palette[i] = 0xff000000 | ((int)rgb[i].r << 16) | ((int)rgb[i].g << 8) | rgb[i].r;
+	writing->f.mode = mode;
+	memcpy(writing->f.palette, pal, (size_t)count * sizeof(uint32_t));
+	writing->f.allDirty = true;
 }
 
-void frame_set4BitPalette(RGB rgb[16])
+void frame_set1BitPalette(const RGB rgb[2])
 {
-	mode = kFrame4bit_2x2;
-	
-	for ( int i = 0; i < 16; ++i )
-		palette[i] = 0xff000000 | ((uint32_t)rgb[i].r << 16) | ((uint32_t)rgb[i].g << 8) | rgb[i].b;
+	setPalette(kFrame1bit, rgb, 2);
+}
+
+void frame_set4BitPalette(const RGB rgb[16])
+{
+	setPalette(kFrame4bit_2x2, rgb, 16);
 }
 
 void frame_setMode(enum FrameMode inmode, uint32_t pal[16])
 {
-	mode = inmode;
-	memcpy(&palette[0], &pal[0], sizeof(palette));
+	writing->f.mode = inmode;
+	memcpy(writing->f.palette, pal, sizeof(writing->f.palette));
+	writing->f.allDirty = true;
 }
 
-void frame_present()
+static bool frameChanged(const FrameSlot* s)
 {
-	if ( mode == kFrame1bit )
-		convertTo32Bit_1bit(framebuffer1bit, framebuffer32bit);
-	else
-		convertTo32Bit_4bit_2x2(framebuffer1bit, framebuffer32bit);
+	if ( s->f.allDirty )
+		return true;
+	
+	for ( unsigned int i = 0; i < sizeof(s->f.dirtyRows); ++i )
+	{
+		if ( s->f.dirtyRows[i] != 0 )
+			return true;
+	}
+	
+	return false;
+}
 
-	SDL_UpdateTexture(sdl_texture, NULL, framebuffer32bit, render_w * 4);
+void frame_present()
+{
+	FrameSlot* done = writing;
+	
+	pthread_mutex_lock(&slotLock);
+	
+	// pause screens and menus resend the same frame over and over, the screen already has it
+	if ( !frameChanged(done) )
+	{
+		uint32_t tag = done->inputTag;
+		
+		// if the last change is still waiting for its due time, that's when this one shows up too
+		if ( queued > 0 && tag > queue[queued-1]->inputTag )
+		{
+			queue[queued-1]->inputTag = tag;
+			tag = 0;
+		}
+		
+		++stats.unchanged;
+		inputtest_frameUnchanged(tag);
+		pthread_mutex_unlock(&slotLock);
+		done->due_us = 0;
+		done->deviceTime_us = UINT64_MAX;
+		done->inputTag = 0;
+		return;
+	}
+	
+	// jitter buffer's full, the oldest frame goes
+	if ( queued == FRAME_QUEUE )
+	{
+		dropFrame(queue[0], queue[1]);
+		memmove(queue, queue + 1, --queued * sizeof(FrameSlot*));
+	}
+	
+	queue[queued++] = done;
+	writing = freeSlots[--numFree];
+	++stats.published;
+	pthread_cond_signal(&frameReady);
+	pthread_mutex_unlock(&slotLock);
+	
+	// rows only come in when they change, so the next frame starts as a copy of this one.
+	// The render thread might be reading done too, but it only touches the dirty rows.
+	memcpy(writing->f.bits, done->f.bits, sizeof(done->f.bits));
+	memcpy(writing->f.palette, done->f.palette, sizeof(done->f.palette));
+	memset(writing->f.dirtyRows, 0, sizeof(writing->f.dirtyRows));
+	writing->f.mode = done->f.mode;
+	writing->f.allDirty = false;
+	writing->due_us = 0;
+	writing->deviceTime_us = UINT64_MAX;
+	writing->inputTag = 0;
+	
+	// no thread to wait on due times, so frames still go up as they arrive
+	if ( !renderThread )
+		renderNext(false);
+}
 
-	int rw, rh;
-	SDL_GetRendererOutputSize(renderer, &rw, &rh);
+void frame_sync()
+{
+	pthread_mutex_lock(&slotLock);
+	
+	while ( stats.presented + stats.skipped < stats.published )
+		pthread_cond_wait(&framePresented, &slotLock);
+	
+	pthread_mutex_unlock(&slotLock);
+}
 
-	SDL_Rect src_rect = { 0, 0, render_w, render_h };
-//	SDL_Rect dst_rect = { 0, 0, rw, rh };
-	SDL_Rect dst_rect = { 40, 0, 1200, 720 }; // XXX don't hardcode
+void frame_getStats(FrameStats* out)
+{
+	pthread_mutex_lock(&slotLock);
+	*out = stats;
+	pthread_mutex_unlock(&slotLock);
+}
 
-	SDL_RenderCopy(renderer, sdl_texture, &src_rect, &dst_rect);
-	SDL_RenderPresent(renderer);
+void frame_report()
+{
+	FrameStats s;
+	frame_sync();
+	frame_getStats(&s);
+	printf("%u frames shown, %u dropped, %u unchanged, %.1f us output CPU per frame\n", s.presented, s.skipped, s.unchanged,
+		   s.presented > 0 ? (double)s.outputCpu_us / s.presented : 0);
+	
+	if ( output->report != NULL )
+		output->report();
 }
 
 #include "pdimage.h"
@@ -202,7 +438,9 @@ const uint8_t digits[10][5] =
 void frame_showWaitScreen(const uint8_t* buf)
 {
 	LOG("showWaitScreen()\n");
+	uint8_t* framebuffer1bit = writing->f.bits;
 	memcpy(framebuffer1bit, image_dat, image_dat_len);
+	writing->f.allDirty = true;
 	
 	// XXX fix in source data instead
 	for ( int i = 0; i < LCD_ROWS * LCD_COLUMNS/8; ++i )
@@ -232,18 +470,27 @@ void frame_showWaitScreen(const uint8_t* buf)
 
 void frame_begin(uint32_t timestamp_ms)
 {
-	// we should delay to match the timestamp, but.. meh.
+	writing->due_us = pacing_frameDue(timestamp_ms, &writing->deviceTime_us);
 }
 
 void frame_end()
 {
-	// post current frame?
+	writing->inputTag = inputtest_frameEnd();
+	
+	// hands the frame to the render thread, doesn't wait for it to be drawn
 	frame_present();
 }
 
 void frame_setRow(unsigned int rowNum, const uint8_t* row)
 {
 	//LOG("row %i\n", rowNum);
-	memcpy(framebuffer1bit + (rowNum-1)*LCD_ROWSIZE, row, LCD_ROWSIZE);
+	uint8_t* dst = writing->f.bits + (rowNum-1)*LCD_ROWSIZE;
+	
+	// writing starts as a copy of the last frame, so this is a compare against what's on screen
+	if ( memcmp(dst, row, LCD_ROWSIZE) == 0 )
+		return;
+	
+	memcpy(dst, row, LCD_ROWSIZE);
+	writing->f.dirtyRows[(rowNum-1)/8] |= (uint8_t)(1 << ((rowNum-1)%8));
 }
 
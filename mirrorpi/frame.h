@@ -9,24 +9,52 @@
 #define frame_h
 
 #include <stdbool.h>
-#include "SDL.h"
+#include <stdint.h>
 
 #define LCD_ROWS 240
 #define LCD_COLUMNS 400
 #define LCD_ROWSIZE (LCD_COLUMNS/8)
 
-bool frame_init(SDL_Window* window);
+// spec picks the output, "name" or "name:arg" (see output.h), NULL for the display
+bool frame_init(const char* spec);
+
+// upload one byte per pixel and let the renderer apply the palette, falls back to RGBA
+// for 1-bit palettes it can't represent. Returns false if the renderer can't do it.
+bool frame_setIndexed(bool enable);
+// the frame gets shown when pacing.c says the device timestamp is due
 void frame_begin(uint32_t timestamp);
 void frame_setRow(unsigned int row, const uint8_t* data);
 void frame_end();
+
+// hands the frame to the render thread and returns right away, unless no row
+// changed, in which case there's nothing to convert or present. Frames wait
+// there until they're due; if a newer one is due too, or too many are
+// waiting, the older ones are dropped.
 void frame_present();
+
+// waits until every frame handed off so far has been presented or dropped
+void frame_sync();
+
+typedef struct
+{
+	unsigned int published; // frames handed to the renderer
+	unsigned int presented;
+	unsigned int unchanged; // same as the frame before, never handed off
+	unsigned int skipped; // replaced by a newer frame before they were shown
+	uint64_t outputCpu_us; // render thread CPU time spent in the output
+} FrameStats;
+
+void frame_getStats(FrameStats* stats);
+
+// prints the stats and whatever the output has to say
+void frame_report();
 void frame_showWaitScreen(const uint8_t* addr);
 
 void frame_reset();
 
 typedef struct { uint8_t r; uint8_t g; uint8_t b; } RGB;
 
-void frame_set1BitPalette(RGB palette[2]);
-void frame_set4BitPalette(RGB palette[16]);
+void frame_set1BitPalette(const RGB palette[2]);
+void frame_set4BitPalette(const RGB palette[16]);
 
 #endif /* frame_h */
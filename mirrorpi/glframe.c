@@ -0,0 +1,208 @@
+//
+//  glframe.c
+//  MirrorJr
+//
+
+#if HAVE_GLES2
+
+#include <stdio.h>
+
+#include <GLES2/gl2.h>
+
+#include "glframe.h"
+
+static GLuint programs[2]; // 1-bit, 4-bit 2x2
+static GLuint frameTexture;
+static GLuint paletteTexture;
+static GLuint vertexBuffer;
+static bool fourBit = false;
+
+static const char* vertexSource =
+	"attribute vec2 a_pos;\n"
+	"varying vec2 v_pixel;\n"
+	"void main()\n"
+	"{\n"
+	"	v_pixel = vec2(a_pos.x, 1.0 - a_pos.y) * vec2(400.0, 240.0);\n"
+	"	gl_Position = vec4(a_pos * 2.0 - 1.0, 0.0, 1.0);\n"
+	"}\n";
+
+// No integer ops in GLSL ES 1.00, but everything here is a small whole number
+// or a power of two, so float math is exact even at mediump.
+static const char* fragmentSource =
+	"#ifdef GL_FRAGMENT_PRECISION_HIGH\n"
+	"precision highp float;\n"
+	"#else\n"
+	"precision mediump float;\n"
+	"#endif\n"
+	"uniform sampler2D u_frame;\n"
+	"uniform sampler2D u_palette;\n"
+	"varying vec2 v_pixel;\n"
+	"float bit(float x, float y)\n"
+	"{\n"
+	"	float byte = floor(texture2D(u_frame, vec2((floor(x / 8.0) + 0.5) / 50.0, (y + 0.5) / 240.0)).r * 255.0 + 0.5);\n"
+	"	return mod(floor(byte / exp2(7.0 - mod(x, 8.0))), 2.0);\n"
+	"}\n"
+	"void main()\n"
+	"{\n"
+	"	vec2 p = floor(v_pixel);\n"
+	"#if FOURBIT\n"
+	"	p -= mod(p, 2.0);\n"
+	"	float index = 8.0 * bit(p.x, p.y) + 4.0 * bit(p.x + 1.0, p.y) + 2.0 * bit(p.x, p.y + 1.0) + bit(p.x + 1.0, p.y + 1.0);\n"
+	"#else\n"
+	"	float index = bit(p.x, p.y);\n"
+	"#endif\n"
+	"	gl_FragColor = texture2D(u_palette, vec2((index + 0.5) / 16.0, 0.5));\n"
+	"}\n";
+
+static GLuint compile(GLenum type, const char* header, const char* source)
+{
+	GLuint shader = glCreateShader(type);
+	const char* sources[2] = { header, source };
+	GLint ok;
+
+	glShaderSource(shader, 2, sources, NULL);
+	glCompileShader(shader);
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+
+	if ( !ok )
+	{
+		char log[512];
+		glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+		printf("shader compile failed: %s\n", log);
+		glDeleteShader(shader);
+		return 0;
+	}
+
+	return shader;
+}
+
+static GLuint link(const char* header)
+{
+	GLuint vs = compile(GL_VERTEX_SHADER, "", vertexSource);
+	GLuint fs = compile(GL_FRAGMENT_SHADER, header, fragmentSource);
+
+	if ( vs == 0 || fs == 0 )
+		return 0;
+
+	GLuint program = glCreateProgram();
+	GLint ok;
+
+	glAttachShader(program, vs);
+	glAttachShader(program, fs);
+	glBindAttribLocation(program, 0, "a_pos");
+	glLinkProgram(program);
+	glDeleteShader(vs);
+	glDeleteShader(fs);
+	glGetProgramiv(program, GL_LINK_STATUS, &ok);
+
+	if ( !ok )
+	{
+		char log[512];
+		glGetProgramInfoLog(program, sizeof(log), NULL, log);
+		printf("shader link failed: %s\n", log);
+		glDeleteProgram(program);
+		return 0;
+	}
+
+	glUseProgram(program);
+	glUniform1i(glGetUniformLocation(program, "u_frame"), 0);
+	glUniform1i(glGetUniformLocation(program, "u_palette"), 1);
+	return program;
+}
+
+static GLuint makeTexture(GLenum format, int width, int height)
+{
+	GLuint texture;
+
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, (GLint)format, width, height, 0, format, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	return texture;
+}
+
+bool glframe_init()
+{
+	programs[0] = link("#define FOURBIT 0\n");
+	programs[1] = link("#define FOURBIT 1\n");
+
+	if ( programs[0] == 0 || programs[1] == 0 )
+		return false;
+
+	// rows are 50 bytes
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	frameTexture = makeTexture(GL_LUMINANCE, LCD_ROWSIZE, LCD_ROWS);
+	paletteTexture = makeTexture(GL_RGBA, 16, 1);
+
+	static const GLfloat quad[] = { 0, 0, 1, 0, 0, 1, 1, 1 };
+	glGenBuffers(1, &vertexBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+	glEnableVertexAttribArray(0);
+
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, paletteTexture);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, frameTexture);
+
+	return glGetError() == GL_NO_ERROR;
+}
+
+void glframe_update(const OutputFrame* f)
+{
+	fourBit = f->mode != kFrame1bit;
+
+	if ( f->allDirty )
+	{
+		// 0xAARRGGBB to RGBA bytes
+		uint8_t rgba[16][4];
+
+		for ( int i = 0; i < 16; ++i )
+		{
+			rgba[i][0] = (uint8_t)(f->palette[i] >> 16);
+			rgba[i][1] = (uint8_t)(f->palette[i] >> 8);
+			rgba[i][2] = (uint8_t)f->palette[i];
+			rgba[i][3] = (uint8_t)(f->palette[i] >> 24);
+		}
+
+		glActiveTexture(GL_TEXTURE1);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, fourBit ? 16 : 2, 1, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	unsigned int row = 0, first, end;
+
+	while ( output_nextSpan(f, &row, &first, &end) )
+	{
+		// a 4-bit block reads both of its rows
+		if ( fourBit )
+		{
+			first &= ~1u;
+			end = (end + 1) & ~1u;
+		}
+
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, (GLint)first, LCD_ROWSIZE, (GLsizei)(end - first), GL_LUMINANCE, GL_UNSIGNED_BYTE, f->bits + first * LCD_ROWSIZE);
+	}
+}
+
+void glframe_draw(int width, int height)
+{
+	int x, y, w, h;
+
+	output_letterbox(width, height, &x, &y, &w, &h);
+
+	glViewport(0, 0, width, height);
+	glClearColor(0, 0, 0, 1);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	glViewport(x, y, w, h);
+	glUseProgram(programs[fourBit]);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+}
+
+#endif
@@ -0,0 +1,27 @@
+//
+//  glframe.h
+//  MirrorJr
+//
+//  Draws frames with OpenGL ES 2 straight from the packed bits: the 12 KB
+//  framebuffer goes up as a 50x240 single-channel texture, the palette as a
+//  16x1 one, and a fragment shader does the bit extraction, the 4-bit 2x2
+//  decode and the scaling. Needs a current GLES2 context, whoever made it.
+//
+
+#ifndef glframe_h
+#define glframe_h
+
+#include <stdbool.h>
+
+#include "output.h"
+
+bool glframe_init();
+
+// uploads the frame's dirty rows (and the palette, when everything's dirty)
+void glframe_update(const OutputFrame* frame);
+
+// draws into the current framebuffer, the largest whole multiple of 400x240
+// that fits, centered, or scaled down to fit if not even 1x does
+void glframe_draw(int width, int height);
+
+#endif /* glframe_h */
@@ -0,0 +1,181 @@
+//
+//  hotplug.c
+//  MirrorJr
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "hotplug.h"
+#include "events.h"
+#include "serial.h"
+
+#if TARGET_RPI
+#include <libudev.h>
+
+static struct udev* udev = NULL;
+static struct udev_monitor* monitor = NULL;
+#endif
+
+#define PLAYDATE_VENDOR "1331"
+#define PLAYDATE_MODEL "5740"
+
+static char* devnode = NULL;
+
+static int fakefd = -1;
+static char fakeline[256];
+static size_t fakelen = 0;
+
+static void deviceEvent(const char* action, const char* node, const char* vendor, const char* model)
+{
+	if ( action == NULL || node == NULL )
+		return;
+
+	if ( strcmp(action, "add") == 0 )
+	{
+		if ( vendor == NULL || model == NULL || strcmp(vendor, PLAYDATE_VENDOR) != 0 || strcmp(model, PLAYDATE_MODEL) != 0 )
+			return;
+
+		printf("Playdate appeared at %s\n", node);
+		free(devnode);
+		devnode = strdup(node);
+	}
+	else if ( strcmp(action, "remove") == 0 && devnode != NULL && strcmp(node, devnode) == 0 )
+	{
+		printf("Playdate at %s went away\n", node);
+		free(devnode);
+		devnode = NULL;
+	}
+}
+
+static bool initFake(const char* path, unsigned int event)
+{
+	// O_RDWR keeps a FIFO from hitting EOF every time the writer closes it
+	fakefd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+	if ( fakefd == -1 )
+	{
+		printf("couldn't open fake hotplug source %s\n", path);
+		return false;
+	}
+
+	return events_watch(fakefd, event);
+}
+
+static void processFake()
+{
+	ssize_t n;
+
+	while ( (n = read(fakefd, fakeline + fakelen, sizeof(fakeline) - 1 - fakelen)) > 0 )
+	{
+		fakelen += (size_t)n;
+		fakeline[fakelen] = '\0';
+
+		char* line = fakeline;
+		char* end;
+
+		while ( (end = strchr(line, '\n')) != NULL )
+		{
+			*end = '\0';
+
+			char* save = NULL;
+			const char* action = strtok_r(line, " \t\r", &save);
+			const char* node = strtok_r(NULL, " \t\r", &save);
+			const char* vendor = strtok_r(NULL, " \t\r", &save);
+			const char* model = strtok_r(NULL, " \t\r", &save);
+
+			deviceEvent(action, node, vendor, model);
+			line = end + 1;
+		}
+
+		fakelen -= (size_t)(line - fakeline);
+		memmove(fakeline, line, fakelen);
+
+		// line too long to be anything we know, throw it out
+		if ( fakelen == sizeof(fakeline) - 1 )
+			fakelen = 0;
+	}
+}
+
+#if TARGET_RPI
+static bool initMonitor(unsigned int event)
+{
+	udev = udev_new();
+
+	if ( udev == NULL )
+		return false;
+
+	monitor = udev_monitor_new_from_netlink(udev, "udev");
+
+	// the kernel side can only filter on subsystem, vendor and model get checked in deviceEvent()
+	if ( monitor == NULL || udev_monitor_filter_add_match_subsystem_devtype(monitor, "tty", NULL) < 0 || udev_monitor_enable_receiving(monitor) < 0 )
+	{
+		printf("couldn't set up udev monitor\n");
+
+		if ( monitor != NULL )
+			udev_monitor_unref(monitor);
+
+		udev_unref(udev);
+		monitor = NULL;
+		udev = NULL;
+		return false;
+	}
+
+	return events_watch(udev_monitor_get_fd(monitor), event);
+}
+
+static void processMonitor()
+{
+	struct udev_device* dev;
+
+	while ( (dev = udev_monitor_receive_device(monitor)) != NULL )
+	{
+		deviceEvent(udev_device_get_action(dev), udev_device_get_devnode(dev),
+					udev_device_get_property_value(dev, "ID_USB_VENDOR_ID"),
+					udev_device_get_property_value(dev, "ID_USB_MODEL_ID"));
+
+		udev_device_unref(dev);
+	}
+}
+#endif
+
+bool hotplug_init(const char* fakePath, unsigned int event)
+{
+	bool ok;
+
+	if ( fakePath != NULL )
+		ok = initFake(fakePath, event);
+	else
+	{
+#if TARGET_RPI
+		ok = initMonitor(event);
+#else
+		ok = false;
+#endif
+	}
+
+	if ( !ok )
+		return false;
+
+	// anything plugged in before we started listening won't get an add event
+	devnode = ser_findDevice();
+	return true;
+}
+
+void hotplug_process()
+{
+	if ( fakefd != -1 )
+		processFake();
+#if TARGET_RPI
+	else if ( monitor != NULL )
+		processMonitor();
+#endif
+}
+
+const char* hotplug_getDevice()
+{
+	return devnode;
+}
@@ -0,0 +1,30 @@
+//
+//  hotplug.h
+//  MirrorJr
+//
+//  Keeps track of where the Playdate's tty is so we don't have to enumerate
+//  every tty while we wait for one. On the Pi this listens on a udev monitor
+//  socket; a fake source reads the same add/remove events as text lines from
+//  a file or FIFO so the connect path can be exercised without hardware:
+//
+//    add /dev/ttyACM0 1331 5740
+//    remove /dev/ttyACM0
+//
+
+#ifndef hotplug_h
+#define hotplug_h
+
+#include <stdbool.h>
+
+// watches for the Playdate and raises event when it comes or goes. fakePath
+// replaces the udev monitor if not NULL. Returns false if there's nothing to
+// watch on this platform, in which case the caller has to poll ser_open().
+bool hotplug_init(const char* fakePath, unsigned int event);
+
+// handles pending add/remove notifications, call when the event fires
+void hotplug_process();
+
+// devnode of the connected Playdate, or NULL if there isn't one
+const char* hotplug_getDevice();
+
+#endif /* hotplug_h */
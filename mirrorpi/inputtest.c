@@ -0,0 +1,182 @@
+//
+//  inputtest.c
+//  MirrorJr
+//
+
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "inputtest.h"
+#include "stream.h"
+
+#define TEST_BUTTON 5 // "a" in stream.c's key names
+#define TEST_BUTTON_MASK 0x20 // and where the device reports it
+#define TIMEOUT_US 2000000
+
+// samples finish on the render thread, so everything's under lock
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static InputTestStats stats;
+static unsigned int interval_us = 0;
+
+static bool pressed = false;
+static bool waiting = false; // toggle sent, not on screen yet
+static bool stateSeen = false; // device has reflected it, the next frame gets tagged
+static uint32_t toggleSeq = 0; // the tag for the toggle we're waiting on
+static uint64_t sent_us = 0;
+static uint64_t next_us = 0;
+
+static uint64_t now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+void inputtest_start(unsigned int interval_ms)
+{
+	pthread_mutex_lock(&lock);
+	stats = (InputTestStats){ .minLatency_us = UINT64_MAX };
+	interval_us = interval_ms * 1000;
+	pressed = false;
+	waiting = false;
+	stateSeen = false;
+	next_us = now_us() + interval_us;
+	pthread_mutex_unlock(&lock);
+}
+
+void inputtest_tick()
+{
+	if ( interval_us == 0 )
+		return;
+
+	uint64_t now = now_us();
+
+	pthread_mutex_lock(&lock);
+
+	if ( waiting && now - sent_us > TIMEOUT_US )
+	{
+		printf("input test: button %s never showed up\n", pressed ? "press" : "release");
+		++stats.timeouts;
+		waiting = false;
+		next_us = now;
+	}
+
+	bool due = !waiting && now >= next_us;
+
+	if ( due )
+	{
+		pressed = !pressed;
+		waiting = true;
+		stateSeen = false;
+		++toggleSeq;
+		sent_us = now;
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	if ( !due )
+		return;
+
+	if ( pressed )
+		stream_sendButtonPress(TEST_BUTTON);
+	else
+		stream_sendButtonRelease(TEST_BUTTON);
+}
+
+void inputtest_deviceState(uint8_t buttonMask)
+{
+	pthread_mutex_lock(&lock);
+
+	if ( waiting && ((buttonMask & TEST_BUTTON_MASK) != 0) == pressed )
+		stateSeen = true;
+
+	pthread_mutex_unlock(&lock);
+}
+
+uint32_t inputtest_frameEnd()
+{
+	uint32_t tag = 0;
+
+	pthread_mutex_lock(&lock);
+
+	if ( stateSeen )
+	{
+		tag = toggleSeq;
+		stateSeen = false;
+	}
+
+	pthread_mutex_unlock(&lock);
+	return tag;
+}
+
+// under lock
+static void finish(uint32_t tag)
+{
+	if ( tag == 0 || !waiting || tag != toggleSeq )
+		return;
+
+	uint64_t now = now_us();
+	uint64_t latency = now - sent_us;
+
+	++stats.samples;
+	stats.totalLatency_us += latency;
+
+	if ( latency < stats.minLatency_us )
+		stats.minLatency_us = latency;
+	if ( latency > stats.maxLatency_us )
+		stats.maxLatency_us = latency;
+
+	waiting = false;
+	next_us = now + interval_us;
+}
+
+void inputtest_framePresented(uint32_t tag)
+{
+	pthread_mutex_lock(&lock);
+	++stats.frames;
+	finish(tag);
+	pthread_mutex_unlock(&lock);
+}
+
+void inputtest_frameUnchanged(uint32_t tag)
+{
+	pthread_mutex_lock(&lock);
+	++stats.unchanged;
+	finish(tag);
+	pthread_mutex_unlock(&lock);
+}
+
+void inputtest_frameSkipped()
+{
+	pthread_mutex_lock(&lock);
+	++stats.skipped;
+	pthread_mutex_unlock(&lock);
+}
+
+void inputtest_getStats(InputTestStats* out)
+{
+	pthread_mutex_lock(&lock);
+	*out = stats;
+	pthread_mutex_unlock(&lock);
+}
+
+bool inputtest_report()
+{
+	InputTestStats s;
+	inputtest_getStats(&s);
+
+	printf("%u frames presented, %u skipped, %u unchanged\n", s.frames, s.skipped, s.unchanged);
+
+	if ( interval_us == 0 )
+		return s.frames > 0;
+
+	if ( s.samples > 0 )
+		printf("input to frame latency: %u samples, min %.2f avg %.2f max %.2f ms, %u timeouts\n",
+			   s.samples, s.minLatency_us / 1000.0, s.totalLatency_us / 1000.0 / s.samples,
+			   s.maxLatency_us / 1000.0, s.timeouts);
+	else
+		printf("input to frame latency: no samples, %u timeouts\n", s.timeouts);
+
+	return s.frames > 0 && s.samples > 0 && s.timeouts == 0;
+}
@@ -0,0 +1,54 @@
+//
+//  inputtest.h
+//  MirrorJr
+//
+//  Synthetic input for measuring input-to-frame latency: toggles the A button
+//  at a fixed interval and times how long it takes until a frame following a
+//  device state report with the new button state has been presented. That
+//  frame is tagged when it's parsed and the render thread finishes the sample
+//  when it reaches the screen, pacing delay and all.
+//
+
+#ifndef inputtest_h
+#define inputtest_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct
+{
+	unsigned int frames; // frames presented while connected
+	unsigned int skipped; // replaced by a newer frame before they were shown
+	unsigned int unchanged; // same as the one before, nothing to show
+	unsigned int samples;
+	unsigned int timeouts; // toggles the device never reflected
+	uint64_t minLatency_us;
+	uint64_t maxLatency_us;
+	uint64_t totalLatency_us;
+} InputTestStats;
+
+// interval_ms of 0 only counts frames
+void inputtest_start(unsigned int interval_ms);
+
+// sends the next toggle when it's due, call from the main loop
+void inputtest_tick();
+
+// from the stream parser
+void inputtest_deviceState(uint8_t buttonMask);
+
+// a frame's finished, returns its tag: nonzero for the first frame after
+// the device reported the toggle. The tag goes with the frame to the screen.
+uint32_t inputtest_frameEnd();
+
+// from frame.c, on whichever thread shows the frame. A skipped frame's tag
+// moves on to the frame that replaces it; an unchanged one is already up.
+void inputtest_framePresented(uint32_t tag);
+void inputtest_frameUnchanged(uint32_t tag);
+void inputtest_frameSkipped();
+
+void inputtest_getStats(InputTestStats* stats);
+
+// prints the stats, returns false if frames or button round trips went missing
+bool inputtest_report();
+
+#endif /* inputtest_h */
@@ -6,6 +6,7 @@
 //
 
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <time.h>
 #include <pthread.h>
@@ -14,6 +15,8 @@
 #include <pwd.h>
 #include <grp.h>
 #include <netinet/in.h>
+#include <limits.h>
+#include <stdlib.h>
 
 #include "SDL.h"
 
@@ -22,6 +25,19 @@
 #include "stream.h"
 #include "serial.h"
 #include "controls.h"
+#include "capture.h"
+#include "replay.h"
+#include "events.h"
+#include "outqueue.h"
+#include "hotplug.h"
+#include "inputtest.h"
+#include "pacing.h"
+#include "avsync.h"
+
+// SDL has no fd we can wait on, so this is how often we check for a quit event while idle
+// (events come in on the thread that made the window, this one; see output_sdlCanThread())
+#define EXIT_POLL_MS 50
+#define POKE_INTERVAL_MS 1000
 
 bool checkExit()
 {
@@ -64,42 +80,62 @@ static void droproot()
 
 int get_ip_address(char *ip_buffer);
 
-int main(int argc, const char * argv[])
+static void usage(const char* name)
 {
-	if ( SDL_InitSubSystem(SDL_INIT_VIDEO) != 0 )
-	{
-		printf("video init failed: %s", SDL_GetError());
-		return false;
-	}
+	printf("usage: %s [--capture <file>] [--replay <file> [--fast]] [--fake-hotplug <fifo>]\n"
+		   "       [--device <tty>] [--input-test <ms>] [--once] [--indexed] [--max-delay <ms>]\n"
+		   "       [--output sdl[:window,upscale]|null|raw:<file>] [--audio-latency <ms>] [--audio-stats]\n", name);
+}
 
-/*
-	int numModes = SDL_GetNumDisplayModes(0);
-	for ( int i = 0; i < numModes; ++i )
+int main(int argc, const char * argv[])
+{
+	const char* capturePath = NULL;
+	const char* replayPath = NULL;
+	bool replayFast = false;
+	const char* fakeHotplugPath = NULL;
+	const char* devicePath = NULL;
+	unsigned int inputTestInterval = 0;
+	bool once = false;
+	bool indexed = false;
+	const char* outputSpec = NULL;
+	
+	for ( int i = 1; i < argc; ++i )
 	{
-		SDL_DisplayMode mode;
-		
-		if ( SDL_GetDisplayMode(0, i, &mode) == 0 )
-			printf("mode %i: fmt=%x w=%i h=%i refresh=%i\n", i, mode.format, mode.w, mode.h, mode.refresh_rate);
+		if ( strcmp(argv[i], "--capture") == 0 && i+1 < argc )
+			capturePath = argv[++i];
+		else if ( strcmp(argv[i], "--replay") == 0 && i+1 < argc )
+			replayPath = argv[++i];
+		else if ( strcmp(argv[i], "--fast") == 0 )
+			replayFast = true;
+		else if ( strcmp(argv[i], "--fake-hotplug") == 0 && i+1 < argc )
+			fakeHotplugPath = argv[++i];
+		else if ( strcmp(argv[i], "--device") == 0 && i+1 < argc )
+			devicePath = argv[++i];
+		else if ( strcmp(argv[i], "--input-test") == 0 && i+1 < argc )
+			inputTestInterval = (unsigned int)atoi(argv[++i]);
+		else if ( strcmp(argv[i], "--once") == 0 )
+			once = true;
+		else if ( strcmp(argv[i], "--indexed") == 0 )
+			indexed = true;
+		else if ( strcmp(argv[i], "--output") == 0 && i+1 < argc )
+			outputSpec = argv[++i];
+		else if ( strcmp(argv[i], "--max-delay") == 0 && i+1 < argc )
+			pacing_setMaxDelay((unsigned int)atoi(argv[++i]));
+		else if ( strcmp(argv[i], "--audio-latency") == 0 && i+1 < argc )
+			audio_setLatency((unsigned int)atoi(argv[++i]));
+		else if ( strcmp(argv[i], "--audio-stats") == 0 )
+			audio_setLiveStats(true);
 		else
-			printf("Couldn't get display mode %i\n", i);
+		{
+			usage(argv[0]);
+			return -1;
+		}
 	}
-*/
-	
-#if TARGET_MACOS
-	SDL_Window* window = SDL_CreateWindow("Playdate", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 1200, 720, SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN);
-#else
-	SDL_Window* window = SDL_CreateWindow("Playdate", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 1280, 720, SDL_WINDOW_OPENGL | SDL_WINDOW_FULLSCREEN);
-#endif
 	
-	if ( window == NULL )
-	{
-		printf("couldn't create window: %s\n", SDL_GetError());
+	if ( !events_init() )
 		return -1;
-	}
-
-	SDL_ShowCursor(SDL_DISABLE);
 	
-	if ( !controls_init() )
+	if ( replayPath == NULL && !controls_init() )
 	{
 		printf("error initializing control i/o\n");
 		return -1;
@@ -111,12 +147,41 @@ int main(int argc, const char * argv[])
 		return -1;
 	}
 	
-	if ( !frame_init(window) )
+	if ( !frame_init(outputSpec) )
 		return -1;
 	
+	if ( indexed && !frame_setIndexed(true) )
+		printf("no indexed output on this renderer, using RGBA\n");
+	
 	audio_init();
 	//droproot();
 	
+	if ( replayPath != NULL )
+	{
+		// no Playdate here: the capture starts right after the "stream enable" we sent, so
+		// the parser picks up the echo just like it would on a live connection
+		stream_begin();
+		
+		// timestamps are meaningless when the capture goes as fast as it can
+		if ( replayFast )
+			pacing_setMaxDelay(0);
+		
+		bool ok = replay_run(replayPath, !replayFast);
+		audio_stop();
+		frame_report();
+		return ok ? 0 : -1;
+	}
+	
+	// without hotplug notifications we're back to looking for the device every time around
+	bool hotplug = devicePath == NULL && hotplug_init(fakeHotplugPath, kEventHotplug);
+	
+	if ( devicePath != NULL )
+		printf("using %s instead of looking for the device\n", devicePath);
+	else if ( !hotplug )
+		printf("no hotplug monitor, polling for the device instead\n");
+	
+	int session = 0;
+	
 	uint8_t ipaddr[INET_ADDRSTRLEN] = "....";
 	get_ip_address((char*)ipaddr);
 	frame_showWaitScreen(ipaddr);
@@ -131,19 +196,48 @@ int main(int argc, const char * argv[])
 
 		while ( !ser_isOpen() )
 		{
+			unsigned int ev = events_wait(EXIT_POLL_MS);
+			
 //			printf("checking exit signal\n");
 
 			if ( checkExit() )
 				return 0;
 			
-			usleep(10000);
-
-//			printf("calling ser_open()\n");
-			ser_open();
+			if ( devicePath != NULL )
+			{
+				ser_openDevice(devicePath);
+				continue;
+			}
+			else if ( !hotplug )
+			{
+//				printf("calling ser_open()\n");
+				ser_open();
+				continue;
+			}
+			
+			if ( ev & kEventHotplug )
+				hotplug_process();
+			
+			// keep trying the cached node until it opens, udev can tell us about
+			// it a little before the permissions are set
+			if ( hotplug_getDevice() != NULL )
+				ser_openDevice(hotplug_getDevice());
 		}
 		
 		printf("connected!\n");
 		stream_begin();
+		
+		if ( capturePath != NULL )
+		{
+			if ( session++ == 0 )
+				capture_start(capturePath);
+			else
+			{
+				char path[PATH_MAX];
+				snprintf(path, sizeof(path), "%s.%i", capturePath, session-1);
+				capture_start(path);
+			}
+		}
 	
 		pthread_attr_t attrs;
 		pthread_attr_init(&attrs);
@@ -158,35 +252,72 @@ int main(int argc, const char * argv[])
 		
 		pthread_attr_destroy(&attrs);
 		
-		time_t lastpoke = 0;
 		starttime = time(NULL);
+		inputtest_start(inputTestInterval);
+		events_startTimer(kEventPokeTimer, POKE_INTERVAL_MS);
 		
 		while ( ser_isOpen() )
 		{
+			unsigned int ev = events_wait(EXIT_POLL_MS);
+			
 			if ( checkExit() )
 				return 0;
 			
-			time_t now = time(NULL);
-			
-			if ( now > lastpoke )
+			if ( ev & kEventPokeTimer )
 			{
 				stream_poke();
-				lastpoke = now;
 				
-				if ( now > starttime )
-					; //printf("%i bytes read, %f kB/s\n", bytesread, (float)bytesread/(now-starttime)/1024.0f);
+				//time_t now = time(NULL);
+				//if ( now > starttime )
+				//	printf("%i bytes read, %f kB/s\n", bytesread, (float)bytesread/(now-starttime)/1024.0f);
+#if DEBUG
+				OutQueueStats oq;
+				outqueue_getStats(&oq);
+				printf("outqueue: %u pending (max %u), %u commands in %u writes, latency avg %llu max %llu us, %u dropped\n",
+					   oq.pending, oq.maxPending, oq.commands, oq.writes,
+					   oq.commands > 0 ? (unsigned long long)(oq.totalLatency_us / oq.commands) : 0,
+					   (unsigned long long)oq.maxLatency_us, oq.dropped);
+#endif
 			}
 			
-			stream_process();
-			controls_scan();
-			usleep(1000);
+			if ( ev & kEventSerialData )
+				stream_process();
+			
+			if ( ev & kEventControls )
+				controls_scan();
+			
+			if ( ev & kEventHotplug )
+				hotplug_process();
+			
+			inputtest_tick();
+			
+			// everything this tick produced goes out in one write (kEventSerialWritable just
+			// gets us back here to finish one that didn't fit)
+			outqueue_flush();
 		}
 		
-		audio_stop();
-		stream_reset();
+		events_stopTimer(kEventPokeTimer);
 		
+		// the reader thread has to be gone before we reset the ring it feeds
 		serial_running = false;
 		pthread_join(readthread, NULL);
+		capture_stop();
+		
+		audio_stop();
+		stream_reset();
+		
+		if ( once )
+		{
+			StreamStats ss;
+			stream_getStats(&ss);
+			printf("%u resyncs, %u bytes skipped\n", ss.resyncs, ss.bytesSkipped);
+			
+			frame_report();
+			pacing_report();
+			audio_report();
+			avsync_report();
+			return inputtest_report() ? 0 : -1;
+		}
 	}
 	
 	return 0;
@@ -196,8 +327,6 @@ void* copySerialToRingbuffer(void* ud)
 {
 	printf("serial monitor started..\n");
 
-	//FILE* log = fopen("log.bin", "w");
-		
 	while ( serial_running )
 	{
 		static uint8_t buf[65536];
@@ -205,11 +334,10 @@ void* copySerialToRingbuffer(void* ud)
 		
 		if ( n > 0 )
 		{
-//			fwrite(buf, 1, (size_t)n, log);
-//			fflush(log);
-
+			capture_addData(buf, (unsigned)n);
 			bytesread += n;
 			stream_addData(buf, (unsigned)n);
+			events_signal(kEventSerialData);
 		}
 		else if ( n < 0 )
 		{
@@ -218,6 +346,9 @@ void* copySerialToRingbuffer(void* ud)
 		}
 	}
 	
+	// wake the main loop so it notices the port closed
+	events_signal(kEventSerialData);
+	
 	printf("serial monitor ended..\n");
 	return NULL;
 }
@@ -0,0 +1,96 @@
+//
+//  output.c
+//  MirrorJr
+//
+
+#include <string.h>
+
+#include "output.h"
+
+// clean rows between two dirty spans cost less to convert than a second texture upload
+#define SPAN_MERGE_GAP 8
+
+static const OutputBackend* backends[] =
+{
+	&output_sdl,
+	&output_null,
+	&output_raw,
+#if HAVE_GLES2
+	&output_gles,
+#endif
+};
+
+const OutputBackend* output_find(const char* spec, const char** arg)
+{
+	if ( spec == NULL )
+		spec = output_sdl.name;
+
+	const char* colon = strchr(spec, ':');
+	size_t len = colon != NULL ? (size_t)(colon - spec) : strlen(spec);
+
+	*arg = colon != NULL ? colon + 1 : NULL;
+
+	for ( unsigned int i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i )
+	{
+		if ( strlen(backends[i]->name) == len && strncmp(backends[i]->name, spec, len) == 0 )
+			return backends[i];
+	}
+
+	return NULL;
+}
+
+static inline bool isDirty(const OutputFrame* f, unsigned int row)
+{
+	return f->allDirty || (f->dirtyRows[row/8] & (1 << (row%8))) != 0;
+}
+
+bool output_nextSpan(const OutputFrame* f, unsigned int* rowp, unsigned int* first, unsigned int* end)
+{
+	unsigned int row = *rowp;
+
+	while ( row < LCD_ROWS && !isDirty(f, row) )
+		++row;
+
+	if ( row == LCD_ROWS )
+	{
+		*rowp = row;
+		return false;
+	}
+
+	*first = row;
+	*end = ++row;
+
+	while ( row < LCD_ROWS && row - *end <= SPAN_MERGE_GAP )
+	{
+		if ( isDirty(f, row) )
+			*end = row + 1;
+
+		++row;
+	}
+
+	*rowp = *end;
+	return true;
+}
+
+void output_letterbox(int width, int height, int* x, int* y, int* w, int* h)
+{
+	int scale = width / LCD_COLUMNS < height / LCD_ROWS ? width / LCD_COLUMNS : height / LCD_ROWS;
+
+	*w = scale * LCD_COLUMNS;
+	*h = scale * LCD_ROWS;
+
+	if ( scale == 0 )
+	{
+		*w = width;
+		*h = width * LCD_ROWS / LCD_COLUMNS;
+
+		if ( *h > height )
+		{
+			*h = height;
+			*w = height * LCD_COLUMNS / LCD_ROWS;
+		}
+	}
+
+	*x = (width - *w) / 2;
+	*y = (height - *h) / 2;
+}
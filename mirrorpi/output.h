@@ -0,0 +1,87 @@
+//
+//  output.h
+//  MirrorJr
+//
+//  Where finished frames go. frame.c decides which frame to show and when;
+//  a backend turns it into pixels somewhere: an SDL window, a raw file, or
+//  nowhere at all for benchmarking the rest of the pipeline.
+//
+
+#ifndef output_h
+#define output_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "frame.h"
+
+enum FrameMode
+{
+	kFrame1bit,
+	kFrame4bit_2x2,
+};
+
+// A frame with the rows that changed since the last one shown. Palette and
+// mode changes redraw everything.
+typedef struct
+{
+	uint8_t bits[LCD_ROWSIZE * LCD_ROWS];
+	uint8_t dirtyRows[LCD_ROWS/8];
+	bool allDirty;
+	enum FrameMode mode;
+	uint32_t palette[16]; // 0xAARRGGBB
+} OutputFrame;
+
+typedef struct
+{
+	const char* name;
+
+	// on the thread that called frame_init(), with whatever followed "name:" in
+	// the output spec (or NULL). This is where windows get made.
+	bool (*open)(const char* arg);
+
+	// on the thread that presents, before the first frame
+	bool (*start)(void);
+
+	// optional, after open(): whether start() and present() can go on a thread
+	// of their own. NULL means they can; otherwise frame.c presents from the
+	// thread that called open().
+	bool (*canThread)(void);
+
+	// whether present() can take indexed = true, after start()
+	bool (*canIndex)(void);
+
+	// draws the frame's dirty rows and shows it. It can set allDirty if it
+	// needs the whole thing; frame.c clears the dirty flags afterwards.
+	void (*present)(OutputFrame* frame, bool indexed);
+
+	// optional, prints what it's been up to
+	void (*report)(void);
+} OutputBackend;
+
+extern const OutputBackend output_sdl;
+extern const OutputBackend output_null;
+extern const OutputBackend output_raw;
+#if HAVE_GLES2
+extern const OutputBackend output_gles;
+#endif
+
+// SDL only supports video calls from the thread that initialised video. The
+// window, its events and the renderer have been split across threads on
+// KMSDRM and X11 without trouble, so those get a render thread and any other
+// driver presents on the main thread. After SDL_InitSubSystem(SDL_INIT_VIDEO).
+bool output_sdlCanThread(void);
+
+// looks up "name" or "name:arg", NULL if there's no such backend
+const OutputBackend* output_find(const char* spec, const char** arg);
+
+// Steps through the runs of dirty rows starting at *row, merging runs with a
+// few clean rows between them since converting those is cheaper than a second
+// upload. Returns false when there are no more.
+bool output_nextSpan(const OutputFrame* frame, unsigned int* row, unsigned int* first, unsigned int* end);
+
+// where the 400x240 image goes on a width x height screen: the biggest whole
+// multiple that fits (or scaled down to fit, on anything smaller), centered
+void output_letterbox(int width, int height, int* x, int* y, int* w, int* h);
+
+#endif /* output_h */
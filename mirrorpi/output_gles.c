@@ -0,0 +1,85 @@
+//
+//  output_gles.c
+//  MirrorJr
+//
+//  "gles" draws with glframe.c in an SDL window's GLES2 context, so the CPU
+//  only uploads the rows that changed, as packed bits. "gles:window" uses a
+//  window instead of going fullscreen. Build with GLES2=1.
+//
+
+#if HAVE_GLES2
+
+#include <stdio.h>
+#include <string.h>
+
+#include "SDL.h"
+#include "output.h"
+#include "glframe.h"
+
+static SDL_Window* window = NULL;
+static SDL_GLContext context = NULL;
+
+static bool gles_open(const char* arg)
+{
+	if ( SDL_InitSubSystem(SDL_INIT_VIDEO) != 0 )
+	{
+		printf("video init failed: %s", SDL_GetError());
+		return false;
+	}
+
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_ES);
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 2);
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 0);
+
+	bool windowed = arg != NULL && strcmp(arg, "window") == 0;
+	window = SDL_CreateWindow("Playdate", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 1280, 720, SDL_WINDOW_OPENGL | (windowed ? SDL_WINDOW_SHOWN : SDL_WINDOW_FULLSCREEN));
+
+	if ( window == NULL )
+	{
+		printf("couldn't create window: %s\n", SDL_GetError());
+		return false;
+	}
+
+	SDL_ShowCursor(SDL_DISABLE);
+	return true;
+}
+
+static bool gles_start()
+{
+	context = SDL_GL_CreateContext(window);
+
+	if ( context == NULL )
+	{
+		printf("couldn't create GLES2 context: %s\n", SDL_GetError());
+		return false;
+	}
+
+	return glframe_init();
+}
+
+static bool gles_canIndex()
+{
+	return false;
+}
+
+static void gles_present(OutputFrame* f, bool indexed)
+{
+	int w, h;
+
+	glframe_update(f);
+	SDL_GL_GetDrawableSize(window, &w, &h);
+	glframe_draw(w, h);
+	SDL_GL_SwapWindow(window);
+}
+
+const OutputBackend output_gles =
+{
+	.name = "gles",
+	.open = gles_open,
+	.start = gles_start,
+	.canThread = output_sdlCanThread,
+	.canIndex = gles_canIndex,
+	.present = gles_present,
+};
+
+#endif
@@ -0,0 +1,54 @@
+//
+//  output_null.c
+//  MirrorJr
+//
+//  Shows nothing, only counts. With a replayed or synthetic stream this
+//  measures everything up to the display.
+//
+
+#include <stdio.h>
+
+#include "output.h"
+
+static unsigned int frames = 0;
+static unsigned int rows = 0;
+
+static bool null_open(const char* arg)
+{
+	return true;
+}
+
+static bool null_start()
+{
+	return true;
+}
+
+static bool null_canIndex()
+{
+	return true;
+}
+
+static void null_present(OutputFrame* f, bool indexed)
+{
+	unsigned int row = 0, first, end;
+
+	while ( output_nextSpan(f, &row, &first, &end) )
+		rows += end - first;
+
+	++frames;
+}
+
+static void null_report()
+{
+	printf("null output: %u frames, %u rows\n", frames, rows);
+}
+
+const OutputBackend output_null =
+{
+	.name = "null",
+	.open = null_open,
+	.start = null_start,
+	.canIndex = null_canIndex,
+	.present = null_present,
+	.report = null_report,
+};
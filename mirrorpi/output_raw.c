@@ -0,0 +1,107 @@
+//
+//  output_raw.c
+//  MirrorJr
+//
+//  "raw:<path>" converts frames into a memory-mapped file holding one
+//  400x240 frame of 32-bit 0xAARRGGBB pixels, rewritten in place, so the
+//  conversion cost is the same as the display's without a GPU anywhere.
+//  Anything that maps the file too can watch it, e.g. a test comparing
+//  against a reference capture.
+//
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "output.h"
+#include "convert.h"
+
+#define PITCH (LCD_COLUMNS * 4)
+#define FILE_SIZE (PITCH * LCD_ROWS)
+
+static uint8_t* pixels = NULL;
+static unsigned int frames = 0;
+
+static bool raw_open(const char* path)
+{
+	if ( path == NULL || *path == '\0' )
+	{
+		printf("raw output needs a file: --output raw:<path>\n");
+		return false;
+	}
+
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+	if ( fd == -1 || ftruncate(fd, FILE_SIZE) != 0 )
+	{
+		printf("couldn't open %s (%i)\n", path, errno);
+
+		if ( fd != -1 )
+			close(fd);
+
+		return false;
+	}
+
+	void* map = mmap(NULL, FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if ( map == MAP_FAILED )
+	{
+		printf("couldn't map %s (%i)\n", path, errno);
+		return false;
+	}
+
+	pixels = map;
+	return true;
+}
+
+static bool raw_start()
+{
+	return true;
+}
+
+static bool raw_canIndex()
+{
+	return false;
+}
+
+static void raw_present(OutputFrame* f, bool indexed)
+{
+	unsigned int row = 0, first, end;
+
+	while ( output_nextSpan(f, &row, &first, &end) )
+	{
+		// 4-bit pixels are 2x2 blocks
+		if ( f->mode != kFrame1bit )
+		{
+			first &= ~1u;
+			end = (end + 1) & ~1u;
+		}
+
+		uint32_t* out = (uint32_t*)(pixels + first * PITCH);
+
+		if ( f->mode == kFrame1bit )
+			convertTo32Bit_1bit(f->bits, out, PITCH, f->palette, first, end - first);
+		else
+			convertTo32Bit_4bit_2x2(f->bits, out, PITCH, f->palette, first, end - first);
+	}
+
+	++frames;
+}
+
+static void raw_report()
+{
+	printf("raw output: %u frames\n", frames);
+}
+
+const OutputBackend output_raw =
+{
+	.name = "raw",
+	.open = raw_open,
+	.start = raw_start,
+	.canIndex = raw_canIndex,
+	.present = raw_present,
+	.report = raw_report,
+};
@@ -0,0 +1,409 @@
+//
+//  output_sdl.c
+//  MirrorJr
+//
+//  The display: converts dirty rows into a streaming texture and scales it
+//  up to the screen. Options after the colon, comma separated: "window" uses
+//  a window instead of going fullscreen, "upscale" has the CPU draw the image
+//  at its final size with exact whole-pixel scaling, split across cores, so
+//  the GPU only copies it (e.g. sdl:window,upscale).
+//
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "SDL.h"
+#include "output.h"
+#include "convert.h"
+#include "bands.h"
+
+static SDL_Window* window = NULL;
+static SDL_Renderer* renderer;
+static SDL_Texture* sdl_texture = NULL;
+
+// indexed output: an IYUV texture takes 1.5 bytes a pixel instead of 4
+static SDL_Texture* yuv_texture = NULL;
+static bool lastPresentIndexed = false;
+static uint8_t* planeY;
+static uint8_t* planeU;
+static uint8_t* planeV;
+static uint8_t yuvPalette[16][3];
+
+// 1-bit frames draw base and add delta where the Y plane is 255
+static uint32_t indexedBase;
+static uint32_t indexedDelta;
+static uint8_t indexedValues[2];
+
+static int render_w = LCD_COLUMNS;
+static int render_h = LCD_ROWS;
+
+// "upscale": sdl_texture is render_w x render_h, scale times the frame, and
+// dirty rows are converted into unscaled first and then blown up into it
+static bool upscaleWanted = false;
+static unsigned int scale = 1;
+static uint32_t* unscaled;
+static uint64_t upscale_us = 0;
+static unsigned int upscaleFrames = 0;
+
+// SDL_PIXELFORMAT_ARGB8888 texture pitch for a single row of the frame
+#define UNSCALED_PITCH (LCD_COLUMNS * 4)
+
+static bool hasOption(const char* arg, const char* name)
+{
+	size_t len = strlen(name);
+
+	while ( arg != NULL )
+	{
+		if ( strncmp(arg, name, len) == 0 && (arg[len] == ',' || arg[len] == '\0') )
+			return true;
+
+		arg = strchr(arg, ',');
+
+		if ( arg != NULL )
+			++arg;
+	}
+
+	return false;
+}
+
+static bool sdl_open(const char* arg)
+{
+	if ( SDL_InitSubSystem(SDL_INIT_VIDEO) != 0 )
+	{
+		printf("video init failed: %s", SDL_GetError());
+		return false;
+	}
+
+/*
+	int numModes = SDL_GetNumDisplayModes(0);
+	for ( int i = 0; i < numModes; ++i )
+	{
+		SDL_DisplayMode mode;
+
+		if ( SDL_GetDisplayMode(0, i, &mode) == 0 )
+			printf("mode %i: fmt=%x w=%i h=%i refresh=%i\n", i, mode.format, mode.w, mode.h, mode.refresh_rate);
+		else
+			printf("Couldn't get display mode %i\n", i);
+	}
+*/
+
+#if TARGET_MACOS
+	window = SDL_CreateWindow("Playdate", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 1200, 720, SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN);
+#else
+	bool windowed = hasOption(arg, "window");
+	window = SDL_CreateWindow("Playdate", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 1280, 720, SDL_WINDOW_OPENGL | (windowed ? SDL_WINDOW_SHOWN : SDL_WINDOW_FULLSCREEN));
+#endif
+
+	if ( window == NULL )
+	{
+		printf("couldn't create window: %s\n", SDL_GetError());
+		return false;
+	}
+
+	upscaleWanted = hasOption(arg, "upscale");
+	SDL_ShowCursor(SDL_DISABLE);
+	return true;
+}
+
+bool output_sdlCanThread()
+{
+	const char* driver = SDL_GetCurrentVideoDriver();
+
+	if ( driver != NULL && (strcmp(driver, "KMSDRM") == 0 || strcmp(driver, "x11") == 0) )
+		return true;
+
+	printf("presenting on the main thread with the %s video driver\n", driver != NULL ? driver : "unknown");
+	return false;
+}
+
+static bool startUpscale()
+{
+	int rw, rh, x, y, w, h;
+	SDL_GetRendererOutputSize(renderer, &rw, &rh);
+	output_letterbox(rw, rh, &x, &y, &w, &h);
+
+	if ( w < LCD_COLUMNS * 2 )
+	{
+		printf("%ix%i is too small to upscale to, letting the renderer scale\n", rw, rh);
+		return false;
+	}
+
+	// a Pi 3 has four cores; the render thread takes one band itself
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if ( !bands_init(cores > 4 ? 4 : cores < 1 ? 1 : (unsigned int)cores) )
+		return false;
+
+	scale = (unsigned int)(w / LCD_COLUMNS);
+	render_w = w;
+	render_h = h;
+	unscaled = malloc(UNSCALED_PITCH * LCD_ROWS);
+
+	printf("upscaling %ix on the cpu, %u bands\n", scale, bands_count());
+	return unscaled != NULL;
+}
+
+static bool sdl_start()
+{
+	renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+
+	if ( renderer == NULL )
+	{
+		printf("couldn't create renderer: %s\n", SDL_GetError());
+		return false;
+	}
+
+	SDL_RendererInfo info;
+
+	if ( SDL_GetRendererInfo(renderer, &info) != 0 )
+	{
+		printf("SDL_GetRendererInfo failed: %s", SDL_GetError());
+		return false;
+	}
+
+	assert(sdl_texture == NULL);
+
+	if ( upscaleWanted && !startUpscale() )
+		upscaleWanted = false;
+
+	// palette entries are 0xAARRGGBB
+	sdl_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, render_w, render_h);
+	assert(sdl_texture);
+	SDL_SetTextureBlendMode(sdl_texture, SDL_BLENDMODE_BLEND);
+
+	// full range, so Y=255 times the color mod is exactly the color mod
+	SDL_SetYUVConversionMode(SDL_YUV_CONVERSION_JPEG);
+
+	// upscaling is the opposite trade: more bytes up for no scaling on the GPU
+	if ( upscaleWanted )
+		return true;
+
+	yuv_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_IYUV, SDL_TEXTUREACCESS_STREAMING, LCD_COLUMNS, LCD_ROWS);
+
+	if ( yuv_texture != NULL )
+	{
+		planeY = calloc(1, LCD_COLUMNS * LCD_ROWS);
+		planeU = calloc(1, LCD_COLUMNS * LCD_ROWS / 4);
+		planeV = calloc(1, LCD_COLUMNS * LCD_ROWS / 4);
+	}
+
+	return true;
+}
+
+static bool sdl_canIndex()
+{
+	return yuv_texture != NULL;
+}
+
+static bool channelsAtLeast(uint32_t a, uint32_t b)
+{
+	return ((a >> 16) & 0xff) >= ((b >> 16) & 0xff) && ((a >> 8) & 0xff) >= ((b >> 8) & 0xff) && (a & 0xff) >= (b & 0xff);
+}
+
+// additive blending can't subtract, so one 1-bit color has to be at least the other in every channel
+static bool setupIndexed1bit(const uint32_t palette[2])
+{
+	if ( channelsAtLeast(palette[1], palette[0]) )
+	{
+		indexedBase = palette[0];
+		indexedDelta = palette[1] - palette[0];
+		indexedValues[0] = 0;
+		indexedValues[1] = 255;
+	}
+	else if ( channelsAtLeast(palette[0], palette[1]) )
+	{
+		indexedBase = palette[1];
+		indexedDelta = palette[0] - palette[1];
+		indexedValues[0] = 255;
+		indexedValues[1] = 0;
+	}
+	else
+		return false;
+
+	return true;
+}
+
+static void updateIndexedSpan(const OutputFrame* f, unsigned int first, unsigned int end)
+{
+	SDL_Rect rect = { 0, (int)first, LCD_COLUMNS, (int)(end - first) };
+	uint8_t* y = planeY + first * LCD_COLUMNS;
+	uint8_t* u = planeU + first / 2 * LCD_COLUMNS / 2;
+	uint8_t* v = planeV + first / 2 * LCD_COLUMNS / 2;
+
+	if ( f->mode == kFrame1bit )
+	{
+		convertTo8Bit_1bit(f->bits, y, LCD_COLUMNS, indexedValues, first, end - first);
+
+		// neutral chroma, the color comes from the texture color mod
+		memset(u, 128, (end - first) / 2 * LCD_COLUMNS / 2);
+		memset(v, 128, (end - first) / 2 * LCD_COLUMNS / 2);
+	}
+	else
+		convertToYUV_4bit_2x2(f->bits, y, LCD_COLUMNS, u, v, LCD_COLUMNS / 2, (const uint8_t (*)[3])yuvPalette, first, end - first);
+
+	SDL_UpdateYUVTexture(yuv_texture, &rect, y, LCD_COLUMNS, u, LCD_COLUMNS / 2, v, LCD_COLUMNS / 2);
+}
+
+typedef struct
+{
+	const OutputFrame* frame;
+	uint32_t* pixels; // locked texture rows for the span, from the span's first row
+	unsigned int pitch;
+	unsigned int first;
+} UpscaleJob;
+
+static void upscaleBand(void* ud, unsigned int first, unsigned int end)
+{
+	UpscaleJob* job = ud;
+	const OutputFrame* f = job->frame;
+	uint32_t* in = unscaled + first * LCD_COLUMNS;
+
+	if ( f->mode == kFrame1bit )
+		convertTo32Bit_1bit(f->bits, in, UNSCALED_PITCH, f->palette, first, end - first);
+	else
+		convertTo32Bit_4bit_2x2(f->bits, in, UNSCALED_PITCH, f->palette, first, end - first);
+
+	uint32_t* out = (uint32_t*)((uint8_t*)job->pixels + (first - job->first) * scale * job->pitch);
+	convertScale32(in, UNSCALED_PITCH, out, job->pitch, LCD_COLUMNS, end - first, scale);
+}
+
+static void updateUpscaledSpan(const OutputFrame* f, unsigned int first, unsigned int end)
+{
+	SDL_Rect rect = { 0, (int)(first * scale), render_w, (int)((end - first) * scale) };
+	void* pixels;
+	int pitch;
+
+	if ( SDL_LockTexture(sdl_texture, &rect, &pixels, &pitch) != 0 )
+	{
+		printf("SDL_LockTexture failed: %s\n", SDL_GetError());
+		return;
+	}
+
+	UpscaleJob job = { f, pixels, (unsigned int)pitch, first };
+
+	if ( f->mode == kFrame1bit )
+		convertPrepare_1bit(f->palette);
+
+	// 4-bit bands have to split between 2x2 blocks
+	bands_run(upscaleBand, &job, first, end, 2);
+	SDL_UnlockTexture(sdl_texture);
+}
+
+static void updateSpan(const OutputFrame* f, unsigned int first, unsigned int end, bool indexed)
+{
+	// 4-bit pixels are 2x2 blocks and IYUV chroma covers 2x2 too, so spans have to start and end on even rows
+	if ( f->mode != kFrame1bit || indexed )
+	{
+		first &= ~1u;
+		end = (end + 1) & ~1u;
+	}
+
+	if ( indexed )
+	{
+		updateIndexedSpan(f, first, end);
+		return;
+	}
+
+	if ( upscaleWanted )
+	{
+		updateUpscaledSpan(f, first, end);
+		return;
+	}
+
+	// convert straight into the texture, the locked pixels are write-only so every row in the rect gets filled
+	SDL_Rect rect = { 0, (int)first, render_w, (int)(end - first) };
+	void* pixels;
+	int pitch;
+
+	if ( SDL_LockTexture(sdl_texture, &rect, &pixels, &pitch) != 0 )
+	{
+		printf("SDL_LockTexture failed: %s\n", SDL_GetError());
+		return;
+	}
+
+	if ( f->mode == kFrame1bit )
+		convertTo32Bit_1bit(f->bits, pixels, (unsigned int)pitch, f->palette, first, end - first);
+	else
+		convertTo32Bit_4bit_2x2(f->bits, pixels, (unsigned int)pitch, f->palette, first, end - first);
+
+	SDL_UnlockTexture(sdl_texture);
+}
+
+static void sdl_present(OutputFrame* f, bool indexedWanted)
+{
+	bool indexed = indexedWanted && (f->mode != kFrame1bit || setupIndexed1bit(f->palette));
+
+	// the other texture is out of date
+	if ( indexed != lastPresentIndexed )
+	{
+		f->allDirty = true;
+		lastPresentIndexed = indexed;
+	}
+
+	if ( indexed && f->mode != kFrame1bit && f->allDirty )
+		convertPaletteToYUV(f->palette, yuvPalette, 16);
+
+	unsigned int row = 0, first, end;
+	struct timespec start, stop;
+
+	if ( upscaleWanted )
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while ( output_nextSpan(f, &row, &first, &end) )
+		updateSpan(f, first, end, indexed);
+
+	if ( upscaleWanted )
+	{
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+		upscale_us += (uint64_t)((stop.tv_sec - start.tv_sec) * 1000000 + (stop.tv_nsec - start.tv_nsec) / 1000);
+		++upscaleFrames;
+	}
+
+	// recomputed every frame, the window can change size
+	int rw, rh;
+	SDL_GetRendererOutputSize(renderer, &rw, &rh);
+
+	SDL_Rect src_rect = { 0, 0, render_w, render_h };
+	SDL_Rect dst_rect;
+	output_letterbox(rw, rh, &dst_rect.x, &dst_rect.y, &dst_rect.w, &dst_rect.h);
+
+	if ( indexed && f->mode == kFrame1bit )
+	{
+		SDL_SetRenderDrawColor(renderer, (indexedBase >> 16) & 0xff, (indexedBase >> 8) & 0xff, indexedBase & 0xff, 0xff);
+		SDL_RenderFillRect(renderer, &dst_rect);
+		SDL_SetTextureColorMod(yuv_texture, (indexedDelta >> 16) & 0xff, (indexedDelta >> 8) & 0xff, indexedDelta & 0xff);
+		SDL_SetTextureBlendMode(yuv_texture, SDL_BLENDMODE_ADD);
+		SDL_RenderCopy(renderer, yuv_texture, &src_rect, &dst_rect);
+	}
+	else if ( indexed )
+	{
+		SDL_SetTextureColorMod(yuv_texture, 0xff, 0xff, 0xff);
+		SDL_SetTextureBlendMode(yuv_texture, SDL_BLENDMODE_NONE);
+		SDL_RenderCopy(renderer, yuv_texture, &src_rect, &dst_rect);
+	}
+	else
+		SDL_RenderCopy(renderer, sdl_texture, &src_rect, &dst_rect);
+
+	SDL_RenderPresent(renderer);
+}
+
+static void sdl_report()
+{
+	if ( upscaleWanted && upscaleFrames > 0 )
+		printf("sdl output: %ux upscale in %u bands, %.1f us per frame\n", scale, bands_count(), (double)upscale_us / upscaleFrames);
+}
+
+const OutputBackend output_sdl =
+{
+	.name = "sdl",
+	.open = sdl_open,
+	.start = sdl_start,
+	.canThread = output_sdlCanThread,
+	.canIndex = sdl_canIndex,
+	.present = sdl_present,
+	.report = sdl_report,
+};
@@ -0,0 +1,194 @@
+//
+//  outqueue.c
+//  MirrorJr
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "outqueue.h"
+#include "serial.h"
+#include "events.h"
+
+#define QUEUE_SIZE 1024
+
+typedef struct
+{
+	char data[QUEUE_SIZE];
+	unsigned int len;
+	unsigned int commands;
+	uint64_t oldest_us; // when the first command in here was queued
+} CommandList;
+
+static CommandList queues[2];
+static float crankChange = 0;
+static uint64_t crankQueued_us = 0;
+
+// assembled commands, some of which may already have been written
+static char outbuf[2 * QUEUE_SIZE + 32];
+static unsigned int outlen = 0;
+static unsigned int outpos = 0;
+static unsigned int outcommands = 0;
+static uint64_t outqueued_us = 0;
+
+static bool waitingForWritable = false;
+static OutQueueStats stats;
+
+static uint64_t now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void addPending(unsigned int n)
+{
+	stats.pending += n;
+
+	if ( stats.pending > stats.maxPending )
+		stats.maxPending = stats.pending;
+}
+
+void outqueue_push(const char* cmd, enum OutQueuePriority priority)
+{
+	CommandList* q = &queues[priority];
+	unsigned int n = (unsigned int)strlen(cmd);
+
+	if ( q->len + n > QUEUE_SIZE )
+	{
+		++stats.dropped;
+		return;
+	}
+
+	if ( q->len == 0 )
+		q->oldest_us = now_us();
+
+	memcpy(q->data + q->len, cmd, n);
+	q->len += n;
+	++q->commands;
+	addPending(n);
+}
+
+void outqueue_pushCrankChange(float change)
+{
+	if ( crankChange == 0 )
+		crankQueued_us = now_us();
+
+	crankChange += change;
+}
+
+static void takeQueue(CommandList* q)
+{
+	if ( q->len == 0 )
+		return;
+
+	if ( outcommands == 0 || q->oldest_us < outqueued_us )
+		outqueued_us = q->oldest_us;
+
+	memcpy(outbuf + outlen, q->data, q->len);
+	outlen += q->len;
+	outcommands += q->commands;
+	q->len = 0;
+	q->commands = 0;
+}
+
+// move queued commands into outbuf in priority order, once the last batch is all out
+static void assemble()
+{
+	if ( outpos < outlen )
+		return;
+
+	outlen = outpos = outcommands = 0;
+
+	takeQueue(&queues[kOutQueueHigh]);
+
+	if ( crankChange != 0 )
+	{
+		int n = snprintf(outbuf + outlen, sizeof(outbuf) - outlen, "changecrank %.1f\r\n", crankChange);
+
+		if ( outcommands == 0 || crankQueued_us < outqueued_us )
+			outqueued_us = crankQueued_us;
+
+		outlen += (unsigned int)n;
+		++outcommands;
+		addPending((unsigned int)n);
+		crankChange = 0;
+	}
+
+	takeQueue(&queues[kOutQueueLow]);
+}
+
+static void setWaitingForWritable(bool wait)
+{
+	if ( wait == waitingForWritable )
+		return;
+
+	if ( wait )
+		events_watchWritable(ser_getFd(), kEventSerialWritable);
+	else
+		events_unwatch(ser_getFd());
+
+	waitingForWritable = wait;
+}
+
+bool outqueue_flush()
+{
+	for ( ;; )
+	{
+		assemble();
+
+		if ( outpos == outlen )
+			break;
+
+		ssize_t n = ser_writeNonblocking(outbuf + outpos, outlen - outpos);
+
+		if ( n < 0 )
+		{
+			// port's gone
+			outqueue_reset();
+			return true;
+		}
+
+		if ( n == 0 )
+			break; // full, wait until it's writable
+
+		outpos += (unsigned int)n;
+		stats.pending -= (unsigned int)n;
+		++stats.writes;
+
+		if ( outpos == outlen )
+		{
+			uint64_t latency = now_us() - outqueued_us;
+
+			if ( latency > stats.maxLatency_us )
+				stats.maxLatency_us = latency;
+
+			stats.totalLatency_us += latency * outcommands;
+			stats.commands += outcommands;
+		}
+	}
+
+	setWaitingForWritable(outpos < outlen);
+	return outpos == outlen;
+}
+
+void outqueue_reset()
+{
+	queues[kOutQueueHigh].len = queues[kOutQueueHigh].commands = 0;
+	queues[kOutQueueLow].len = queues[kOutQueueLow].commands = 0;
+	crankChange = 0;
+	outlen = outpos = outcommands = 0;
+	stats.pending = 0;
+
+	// closing the fd already took it out of the epoll set, but a reconnect keeps it open
+	if ( waitingForWritable && ser_isOpen() )
+		events_unwatch(ser_getFd());
+
+	waitingForWritable = false;
+}
+
+void outqueue_getStats(OutQueueStats* out)
+{
+	*out = stats;
+}
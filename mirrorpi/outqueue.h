@@ -0,0 +1,45 @@
+//
+//  outqueue.h
+//  MirrorJr
+//
+//  Commands for the device collect here during a main loop tick and go out
+//  in a single non-blocking write at the end of it. Button events go ahead
+//  of everything else, crank changes are summed into one "changecrank", and
+//  whatever the port can't take right now waits until it's writable again.
+//
+
+#ifndef outqueue_h
+#define outqueue_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum OutQueuePriority
+{
+	kOutQueueHigh, // buttons, crank dock
+	kOutQueueLow, // pokes, stream options
+};
+
+typedef struct
+{
+	unsigned int pending; // bytes queued or partially written
+	unsigned int maxPending;
+	unsigned int writes; // write() calls that sent something
+	unsigned int commands;
+	unsigned int dropped; // commands that didn't fit
+	uint64_t maxLatency_us; // queued to written, worst case
+	uint64_t totalLatency_us;
+} OutQueueStats;
+
+void outqueue_push(const char* cmd, enum OutQueuePriority priority);
+void outqueue_pushCrankChange(float change);
+
+// writes as much as the port will take, returns true if the queue is empty
+bool outqueue_flush();
+
+// drops everything, e.g. when the port closes or the stream is restarted
+void outqueue_reset();
+
+void outqueue_getStats(OutQueueStats* stats);
+
+#endif /* outqueue_h */
@@ -0,0 +1,232 @@
+//
+//  pacing.c
+//  MirrorJr
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "pacing.h"
+#include "avsync.h"
+
+#define WINDOW 128 // frames of arrival history, about 4 s at 30 fps
+#define JITTER_PERCENTILE 95 // the odd USB stall shouldn't hold every frame back
+#define DELAY_MARGIN_US 1000
+#define DELAY_DECAY_US 1000 // per frame, once the jitter has settled down
+#define RESYNC_MS 1000 // timestamp steps bigger than this (or backwards) start over
+#define DEFAULT_MAX_DELAY_MS 50
+#define MAX_AV_DELAY_MS 250 // how far behind the picture may go to wait for the sound
+
+static uint64_t maxDelay_us = DEFAULT_MAX_DELAY_MS * 1000;
+
+// parser side
+
+static bool anchored = false;
+static uint32_t lastTimestamp;
+static uint64_t deviceTime;
+static int64_t samples[WINDOW]; // arrival time - device time
+static unsigned int numSamples = 0;
+static unsigned int nextSample = 0;
+static int64_t latency; // due time - device time
+static uint64_t lastDue;
+
+// renderer side, and the stats, under statsLock
+
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+static PacingStats stats;
+static bool havePresented = false;
+static uint64_t lastPresentTime;
+static uint64_t lastPresentDevice;
+
+uint64_t pacing_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+void pacing_setMaxDelay(unsigned int ms)
+{
+	maxDelay_us = (uint64_t)ms * 1000;
+}
+
+void pacing_reset()
+{
+	anchored = false;
+	numSamples = 0;
+	nextSample = 0;
+
+	pthread_mutex_lock(&statsLock);
+	stats = (PacingStats){ 0 };
+	havePresented = false;
+	pthread_mutex_unlock(&statsLock);
+
+	avsync_reset();
+}
+
+static int compareSamples(const void* a, const void* b)
+{
+	int64_t x = *(const int64_t*)a;
+	int64_t y = *(const int64_t*)b;
+	return (x > y) - (x < y);
+}
+
+uint64_t pacing_frameDue(uint32_t timestamp_ms, uint64_t* deviceTime_us)
+{
+	uint64_t now = pacing_now();
+	int32_t step = (int32_t)(timestamp_ms - lastTimestamp);
+
+	if ( !anchored || step < 0 || step > RESYNC_MS )
+	{
+		if ( anchored )
+		{
+			pthread_mutex_lock(&statsLock);
+			++stats.resyncs;
+			havePresented = false;
+			pthread_mutex_unlock(&statsLock);
+		}
+
+		anchored = true;
+		deviceTime = (uint64_t)timestamp_ms * 1000;
+		numSamples = 0;
+		nextSample = 0;
+		lastDue = 0;
+	}
+	else if ( step == 0 )
+	{
+		// old firmware sends no timestamps, nothing to schedule by
+		lastTimestamp = timestamp_ms;
+		*deviceTime_us = UINT64_MAX;
+		return now;
+	}
+	else
+		deviceTime += (uint64_t)step * 1000;
+
+	lastTimestamp = timestamp_ms;
+	*deviceTime_us = deviceTime;
+	avsync_setVideoTime(deviceTime);
+
+	if ( maxDelay_us == 0 )
+		return now;
+
+	samples[nextSample] = (int64_t)(now - deviceTime);
+	nextSample = (nextSample + 1) % WINDOW;
+
+	if ( numSamples < WINDOW )
+		++numSamples;
+
+	// the fastest recent arrival is our best guess at the clock offset, the spread
+	// above it is how much delay it takes to show most frames on time
+	int64_t sorted[WINDOW];
+	memcpy(sorted, samples, numSamples * sizeof(int64_t));
+	qsort(sorted, numSamples, sizeof(int64_t), compareSamples);
+
+	int64_t base = sorted[0];
+	int64_t spread = sorted[(numSamples - 1) * JITTER_PERCENTILE / 100] - base + DELAY_MARGIN_US;
+
+	if ( spread > (int64_t)maxDelay_us )
+		spread = (int64_t)maxDelay_us;
+
+	int64_t target = base + spread;
+	uint64_t maxDue = maxDelay_us;
+	int64_t audio;
+
+	// with sound playing, show frames when their sound is heard
+	if ( avsync_getAudioLatency(&audio) )
+	{
+		if ( audio > target )
+			target = audio;
+
+		if ( maxDue < MAX_AV_DELAY_MS * 1000 )
+			maxDue = MAX_AV_DELAY_MS * 1000;
+	}
+
+	// grow right away, shrink a little each frame so the cadence on screen doesn't jump
+	if ( numSamples == 1 || target > latency )
+		latency = target;
+	else if ( latency - target > DELAY_DECAY_US )
+		latency -= DELAY_DECAY_US;
+	else
+		latency = target;
+
+	uint64_t due = (uint64_t)((int64_t)deviceTime + latency);
+
+	if ( due < lastDue )
+		due = lastDue;
+
+	if ( due > now + maxDue )
+		due = now + maxDue;
+
+	lastDue = due;
+
+	pthread_mutex_lock(&statsLock);
+	stats.delay_us = (uint64_t)(latency - base);
+	pthread_mutex_unlock(&statsLock);
+
+	return due;
+}
+
+void pacing_presented(uint64_t deviceTime_us, uint64_t due_us)
+{
+	uint64_t now = pacing_now();
+	uint64_t error = now > due_us ? now - due_us : due_us - now;
+
+	avsync_presented(deviceTime_us, now);
+
+	pthread_mutex_lock(&statsLock);
+
+	++stats.frames;
+	stats.totalError_us += error;
+
+	if ( error > stats.maxError_us )
+		stats.maxError_us = error;
+
+	if ( now > due_us + PACING_LATE_US )
+		++stats.late;
+
+	// frames dropped in between don't matter, the gap on screen should match the gap on the device
+	if ( havePresented && deviceTime_us > lastPresentDevice && deviceTime_us - lastPresentDevice <= RESYNC_MS * 1000 )
+	{
+		int64_t drift = (int64_t)(now - lastPresentTime) - (int64_t)(deviceTime_us - lastPresentDevice);
+		uint64_t intervalError = (uint64_t)(drift < 0 ? -drift : drift);
+
+		++stats.intervals;
+		stats.totalIntervalError_us += intervalError;
+
+		if ( intervalError > stats.maxIntervalError_us )
+			stats.maxIntervalError_us = intervalError;
+	}
+
+	havePresented = true;
+	lastPresentTime = now;
+	lastPresentDevice = deviceTime_us;
+
+	pthread_mutex_unlock(&statsLock);
+}
+
+void pacing_getStats(PacingStats* out)
+{
+	pthread_mutex_lock(&statsLock);
+	*out = stats;
+	pthread_mutex_unlock(&statsLock);
+}
+
+void pacing_report()
+{
+	PacingStats s;
+	pacing_getStats(&s);
+
+	if ( s.frames == 0 )
+	{
+		printf("pacing: no timestamped frames\n");
+		return;
+	}
+
+	printf("pacing: %u frames, error avg %.2f max %.2f ms, %u late, interval error avg %.2f max %.2f ms, delay %.1f ms, %u resyncs\n",
+		   s.frames, s.totalError_us / 1000.0 / s.frames, s.maxError_us / 1000.0, s.late,
+		   s.intervals > 0 ? s.totalIntervalError_us / 1000.0 / s.intervals : 0, s.maxIntervalError_us / 1000.0,
+		   s.delay_us / 1000.0, s.resyncs);
+}
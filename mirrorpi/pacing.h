@@ -0,0 +1,51 @@
+//
+//  pacing.h
+//  MirrorJr
+//
+//  Maps the device's frame timestamps onto the local clock so frames can be
+//  shown at the game's cadence instead of whenever USB delivered them. The
+//  delay on top of the fastest arrival we've seen recently adapts to the
+//  arrival jitter, up to a limit.
+//
+
+#ifndef pacing_h
+#define pacing_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct
+{
+	unsigned int frames; // presented with a timestamp
+	unsigned int late; // more than PACING_LATE_US after their due time
+	unsigned int resyncs; // timestamp jumped, mapping started over
+	uint64_t totalError_us; // |present time - due time|
+	uint64_t maxError_us;
+	unsigned int intervals; // consecutive presented frames with comparable timestamps
+	uint64_t totalIntervalError_us; // |present interval - timestamp interval|
+	uint64_t maxIntervalError_us;
+	uint64_t delay_us; // current jitter buffer delay
+} PacingStats;
+
+#define PACING_LATE_US 4000
+
+// 0 turns scheduling off: frames are due when they arrive
+void pacing_setMaxDelay(unsigned int ms);
+
+// starts over, for a new session
+void pacing_reset();
+
+// returns when the frame with this device timestamp should be shown, on the
+// CLOCK_MONOTONIC microsecond clock, and its timestamp extended to 64 bits
+// in *deviceTime_us (or UINT64_MAX if it can't be scheduled)
+uint64_t pacing_frameDue(uint32_t timestamp_ms, uint64_t* deviceTime_us);
+
+// from the renderer, after the frame is on screen
+void pacing_presented(uint64_t deviceTime_us, uint64_t due_us);
+
+uint64_t pacing_now();
+
+void pacing_getStats(PacingStats* stats);
+void pacing_report();
+
+#endif /* pacing_h */
@@ -0,0 +1,121 @@
+//
+//  replay.c
+//  MirrorJr
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "replay.h"
+#include "capture.h"
+#include "stream.h"
+
+// stream_process() drains every complete message, so feeding the ring in pieces this size
+// keeps it from filling up (stream_addData() would wait on the consumer, which is us)
+#define REPLAY_CHUNK_SIZE 4096
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+bool replay_run(const char* path, bool realtime)
+{
+	int fd = open(path, O_RDONLY);
+
+	if ( fd == -1 )
+	{
+		printf("couldn't open %s\n", path);
+		return false;
+	}
+
+	struct stat st;
+
+	if ( fstat(fd, &st) != 0 || st.st_size < CAPTURE_MAGIC_LEN )
+	{
+		printf("%s isn't a capture file\n", path);
+		close(fd);
+		return false;
+	}
+
+	size_t filelen = (size_t)st.st_size;
+	uint8_t* file = mmap(NULL, filelen, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if ( file == MAP_FAILED )
+	{
+		printf("couldn't map %s\n", path);
+		return false;
+	}
+
+	if ( memcmp(file, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0 )
+	{
+		printf("%s isn't a capture file\n", path);
+		munmap(file, filelen);
+		return false;
+	}
+
+	madvise(file, filelen, MADV_SEQUENTIAL);
+
+	size_t pos = CAPTURE_MAGIC_LEN;
+	uint64_t first_ts = 0;
+	uint64_t start = now_ns();
+	unsigned int records = 0;
+	size_t bytes = 0;
+
+	while ( pos + sizeof(CaptureRecord) <= filelen )
+	{
+		CaptureRecord rec;
+		memcpy(&rec, file + pos, sizeof(rec));
+		pos += sizeof(rec);
+
+		if ( rec.length > filelen - pos )
+		{
+			printf("capture truncated at record %u\n", records);
+			break;
+		}
+
+		if ( records == 0 )
+			first_ts = rec.timestamp_ns;
+
+		if ( realtime )
+		{
+			uint64_t due = start + (rec.timestamp_ns - first_ts);
+			uint64_t now = now_ns();
+
+			if ( due > now )
+			{
+				struct timespec delay = { (time_t)((due - now) / 1000000000), (long)((due - now) % 1000000000) };
+				nanosleep(&delay, NULL);
+			}
+		}
+
+		for ( unsigned int off = 0; off < rec.length; off += REPLAY_CHUNK_SIZE )
+		{
+			unsigned int n = rec.length - off < REPLAY_CHUNK_SIZE ? rec.length - off : REPLAY_CHUNK_SIZE;
+			stream_addData(file + pos + off, n);
+			stream_process();
+		}
+
+		pos += rec.length;
+		bytes += rec.length;
+		++records;
+	}
+
+	double elapsed = (double)(now_ns() - start) / 1e9;
+	StreamStats stats;
+	stream_getStats(&stats);
+
+	printf("replayed %u records, %zu bytes in %.3f s (%.2f MB/s)\n", records, bytes, elapsed, elapsed > 0 ? bytes / elapsed / 1e6 : 0);
+	printf("%u resyncs, %u bytes skipped\n", stats.resyncs, stats.bytesSkipped);
+
+	munmap(file, filelen);
+	return true;
+}
@@ -0,0 +1,16 @@
+//
+//  replay.h
+//  MirrorJr
+//
+//  Feeds a file written by capture.c back through the stream parser, either
+//  with the original chunk timing or as fast as possible.
+//
+
+#ifndef replay_h
+#define replay_h
+
+#include <stdbool.h>
+
+bool replay_run(const char* path, bool realtime);
+
+#endif /* replay_h */
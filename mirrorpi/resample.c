@@ -0,0 +1,136 @@
+//
+//  resample.c
+//  MirrorJr
+//
+
+#include <string.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "resample.h"
+
+void resample_init(Resampler* r, unsigned int channels)
+{
+	memset(r->history, 0, sizeof(r->history));
+	r->step = RESAMPLE_ONE;
+	r->phase = 0;
+	r->channels = channels;
+}
+
+void resample_setRatio(Resampler* r, double ratio)
+{
+	uint32_t step = (uint32_t)(ratio * RESAMPLE_ONE + 0.5);
+
+	if ( step == RESAMPLE_ONE && r->step != RESAMPLE_ONE )
+		r->phase = (r->phase + RESAMPLE_ONE / 2) & ~(uint32_t)(RESAMPLE_ONE - 1);
+
+	r->step = step;
+}
+
+// each mono sample written twice, left and right
+static void upmix(const int16_t* in, int16_t* out, unsigned int n)
+{
+	unsigned int i = 0;
+
+#if defined(__ARM_NEON)
+	for ( ; i + 8 <= n; i += 8 )
+	{
+		int16x8_t v = vld1q_s16(in + i);
+		int16x8x2_t pair = { { v, v } };
+		vst2q_s16(out + 2 * i, pair);
+	}
+#elif defined(__SSE2__)
+	for ( ; i + 8 <= n; i += 8 )
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+		_mm_storeu_si128((__m128i*)(out + 2 * i), _mm_unpacklo_epi16(v, v));
+		_mm_storeu_si128((__m128i*)(out + 2 * i + 8), _mm_unpackhi_epi16(v, v));
+	}
+#endif
+
+	for ( ; i < n; ++i )
+		out[2*i] = out[2*i+1] = in[i];
+}
+
+static inline void push(Resampler* r, const int16_t* in)
+{
+	memmove(r->history[0], r->history[1], 3 * sizeof(r->history[0]));
+	r->history[3][0] = in[0];
+	r->history[3][1] = in[r->channels - 1];
+}
+
+// Catmull-Rom between y1 and y2, t in 0..1 as 0.16
+static inline int16_t cubic(int32_t y0, int32_t y1, int32_t y2, int32_t y3, int64_t t)
+{
+	int64_t a = -y0 + 3 * y1 - 3 * y2 + y3;
+	int64_t b = 2 * y0 - 5 * y1 + 4 * y2 - y3;
+	int64_t c = y2 - y0;
+	int64_t v = ((((a * t >> 16) + b) * t >> 16) + c) * t >> 17;
+	int64_t s = y1 + v;
+
+	return s > INT16_MAX ? INT16_MAX : s < INT16_MIN ? INT16_MIN : (int16_t)s;
+}
+
+unsigned int resample_run(Resampler* r, const int16_t* in, unsigned int inFrames, unsigned int* consumed, int16_t* out, unsigned int outFrames)
+{
+	unsigned int used = 0, produced = 0;
+
+	while ( produced < outFrames )
+	{
+		while ( r->phase >= RESAMPLE_ONE && used < inFrames )
+		{
+			push(r, in + used * r->channels);
+			r->phase -= RESAMPLE_ONE;
+			++used;
+		}
+
+		if ( r->phase >= RESAMPLE_ONE )
+			break;
+
+		unsigned int m = outFrames - produced;
+
+		if ( m > inFrames - used + 1 )
+			m = inFrames - used + 1;
+
+		// running at exactly 1: the three frames in history, then the input
+		// straight through, m outputs for m-1 inputs, history ends up the last four
+		if ( r->step == RESAMPLE_ONE && r->phase == 0 && m >= 5 )
+		{
+			int16_t* o = out + 2 * produced;
+			const int16_t* src = in + used * r->channels;
+
+			memcpy(o, r->history[1], 3 * sizeof(r->history[0]));
+
+			if ( r->channels == 1 )
+				upmix(src, o + 6, m - 3);
+			else
+				memcpy(o + 6, src, (m - 3) * 2 * sizeof(int16_t));
+
+			for ( unsigned int i = 0; i < 4; ++i )
+			{
+				const int16_t* f = src + (m - 5 + i) * r->channels;
+				r->history[i][0] = f[0];
+				r->history[i][1] = f[r->channels - 1];
+			}
+
+			used += m - 1;
+			produced += m;
+			r->phase = RESAMPLE_ONE;
+			continue;
+		}
+
+		const int16_t (*h)[2] = (const int16_t (*)[2])r->history;
+
+		out[2 * produced] = cubic(h[0][0], h[1][0], h[2][0], h[3][0], r->phase);
+		out[2 * produced + 1] = cubic(h[0][1], h[1][1], h[2][1], h[3][1], r->phase);
+		++produced;
+		r->phase += r->step;
+	}
+
+	*consumed = used;
+	return produced;
+}
@@ -0,0 +1,38 @@
+//
+//  resample.h
+//  MirrorJr
+//
+//  Plays 16-bit mono or stereo input back at a slightly different rate, for
+//  keeping up with a device whose 44.1 kHz isn't quite ours. Output is
+//  always stereo. Cubic (Catmull-Rom) interpolation in fixed point; at a
+//  ratio of exactly 1 it's a plain copy, three frames late.
+//
+
+#ifndef resample_h
+#define resample_h
+
+#include <stdint.h>
+
+#define RESAMPLE_ONE 65536 // 1.0 in 16.16
+
+typedef struct
+{
+	uint32_t step; // input frames per output frame, 16.16
+	uint32_t phase; // where the next output falls past history[1], 16.16; whole frames are input still to take in
+	int16_t history[4][2]; // the two frames either side of the output
+	unsigned int channels;
+} Resampler;
+
+void resample_init(Resampler* r, unsigned int channels);
+
+// ratio is input frames per output frame, > 1 to play faster. Going back to
+// 1.0 snaps to the nearest input frame, half a sample at most, so the copy
+// path takes over again.
+void resample_setRatio(Resampler* r, double ratio);
+
+// Writes up to outFrames stereo frames, reading from in (inFrames frames of
+// r->channels samples). Returns the frames written; *consumed is set to the
+// input frames used up.
+unsigned int resample_run(Resampler* r, const int16_t* in, unsigned int inFrames, unsigned int* consumed, int16_t* out, unsigned int outFrames);
+
+#endif /* resample_h */
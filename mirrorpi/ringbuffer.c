@@ -6,200 +6,245 @@
 //  Copyright © 2018 Panic, Inc. All rights reserved.
 //
 
+#if defined(__linux__)
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include "ringbuffer.h"
 
+#if !defined(MIN)
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#endif
+
+// The producer owns inpos and the consumer owns outpos. Each side reads its own counter
+// relaxed and the other side's with acquire, and publishes its counter with release after
+// touching the buffer memory, so the consumer never sees the count move before the data
+// it covers has landed (which ARM is otherwise happy to let happen).
+
 void RingBuffer_init(RingBuffer* r)
 {
 	r->buffer = NULL;
 	r->bufferlen = 0;
-//	r->fileOffset = 0;
-	r->inpos = 0;
-	r->outpos = 0;
+	r->mask = 0;
+	r->datasize = 1;
+	r->mirrored = false;
+	atomic_init(&r->inpos, 0);
+	atomic_init(&r->outpos, 0);
 }
 
 void RingBuffer_deinit(RingBuffer* r)
 {
+#if defined(__linux__)
+	if ( r->mirrored )
+		munmap(r->buffer, 2 * r->bufferlen);
+	else
+#endif
 	if ( r->buffer != NULL )
 		free(r->buffer);
+	
+	r->buffer = NULL;
+	r->mirrored = false;
+	r->bufferlen = 0;
+	r->mask = 0;
 }
 
 bool RingBuffer_setSize(RingBuffer* r, unsigned int length, unsigned int datasize)
 {
+	unsigned int size = 1;
+	
+	while ( size < length )
+		size <<= 1;
+	
 	r->datasize = datasize;
 	
-	if ( r->bufferlen == length )
+	if ( r->bufferlen == size && !r->mirrored )
 		return true;
 	
-	if ( length % datasize != 0 )
-		length += 4 - (length % datasize);
+	if ( r->mirrored )
+		RingBuffer_deinit(r);
 	
-	void* buf = realloc(r->buffer, length);
+	void* buf = realloc(r->buffer, size);
 	
 	if ( buf == NULL )
-		return 0;
+		return false;
 	
-	memset(buf, 0, length);
+	memset(buf, 0, size);
 	r->buffer = buf;
-	r->inpos = 0;
-	r->outpos = 0;
-	r->bufferlen = length;
+	r->bufferlen = size;
+	r->mask = size - 1;
+	RingBuffer_reset(r);
 
-	return false;
+	return true;
 }
 
-void RingBuffer_reset(RingBuffer* r)
+bool RingBuffer_setSizeMirrored(RingBuffer* r, unsigned int length, unsigned int datasize)
 {
-	r->outpos = 0;
-	r->inpos = 0;
-//	r->fileOffset = 0;
+#if defined(__linux__)
+	unsigned int size = (unsigned int)sysconf(_SC_PAGESIZE);
+	
+	while ( size < length )
+		size <<= 1;
+	
+	r->datasize = datasize;
+	
+	if ( r->bufferlen == size && r->mirrored )
+		return true;
+	
+	int fd = memfd_create("ringbuffer", MFD_CLOEXEC);
+	
+	if ( fd != -1 && ftruncate(fd, size) == 0 )
+	{
+		// reserve twice the space, then map the file over both halves
+		uint8_t* base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		
+		if ( base != MAP_FAILED &&
+			 mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED &&
+			 mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED )
+		{
+			close(fd);
+			RingBuffer_deinit(r);
+			r->buffer = base;
+			r->bufferlen = size;
+			r->mask = size - 1;
+			r->mirrored = true;
+			RingBuffer_reset(r);
+			return true;
+		}
+		
+		if ( base != MAP_FAILED )
+			munmap(base, 2 * size);
+	}
+	
+	if ( fd != -1 )
+		close(fd);
+	
+	printf("couldn't create mirrored ring buffer, falling back to plain\n");
+#endif
+	return RingBuffer_setSize(r, length, datasize);
 }
 
-unsigned int RingBuffer_getSize(RingBuffer* r)
+// bytes that can be touched starting at pos before we hit the end of the buffer
+static inline unsigned int contiguousFrom(RingBuffer* r, unsigned int pos)
 {
-	return r->bufferlen;
+	return r->mirrored ? r->bufferlen : r->bufferlen - (pos & r->mask);
 }
 
-// XXX - This isn't quite right, should handle case where outpos = 0
-unsigned int RingBuffer_getFreeSpace(RingBuffer* r)
+void RingBuffer_reset(RingBuffer* r)
 {
-	unsigned int o = r->outpos;
-	unsigned int i = r->inpos;
-
-	if ( i < o )
-		return o - i - r->datasize;
-	else
-		return o - r->datasize + r->bufferlen - i;
+	atomic_store_explicit(&r->inpos, 0, memory_order_relaxed);
+	atomic_store_explicit(&r->outpos, 0, memory_order_relaxed);
 }
 
-/*
-unsigned int RingBuffer_getOutputOffset(RingBuffer* r)
+unsigned int RingBuffer_getSize(RingBuffer* r)
 {
-	return r->fileOffset + r->outpos;
+	return r->bufferlen;
 }
 
-void RingBuffer_setOutputOffset(RingBuffer* r, unsigned int offset)
+// producer side
+
+unsigned int RingBuffer_getFreeSpace(RingBuffer* r)
 {
-	r->fileOffset = offset - r->outpos;
+	unsigned int i = atomic_load_explicit(&r->inpos, memory_order_relaxed);
+	unsigned int o = atomic_load_explicit(&r->outpos, memory_order_acquire);
+	unsigned int space = r->bufferlen - (i - o);
+
+	// whole frames only
+	return space - space % r->datasize;
 }
-*/
 
 unsigned int RingBuffer_getInputAvailableSize(RingBuffer* r)
 {
-	// save r->outpos in case another thread changes it
-	unsigned int o = r->outpos;
-	
-	if ( o <= r->inpos )
-		return r->bufferlen - r->inpos;
-	else
-		return o - r->inpos - r->datasize;
+	unsigned int i = atomic_load_explicit(&r->inpos, memory_order_relaxed);
+	unsigned int o = atomic_load_explicit(&r->outpos, memory_order_acquire);
+
+	return MIN(r->bufferlen - (i - o), contiguousFrom(r, i));
 }
 
 void* RingBuffer_getInputPointer(RingBuffer* r)
 {
-	return (uint8_t*)r->buffer + r->inpos;
+	return r->buffer + (atomic_load_explicit(&r->inpos, memory_order_relaxed) & r->mask);
 }
 
 void RingBuffer_moveInputPointer(RingBuffer* r, unsigned int bytes)
 {
-	if ( r->bufferlen == 0 )
-		printf("what??\n");
-	
-	r->inpos = (r->inpos + bytes) % r->bufferlen;
-
-	if ( r->inpos == r->bufferlen && r->outpos > 0 )
-		r->inpos = 0;
+	unsigned int i = atomic_load_explicit(&r->inpos, memory_order_relaxed);
+	atomic_store_explicit(&r->inpos, i + bytes, memory_order_release);
 }
 
-#if !defined(MIN)
-#define MIN(a,b) (((a)<(b))?(a):(b))
-#endif
-
 unsigned int RingBuffer_addData(RingBuffer* r, const void* ptr, unsigned int length)
 {
-	int c = (r->inpos >= r->outpos) ? 2 : 1;
-	unsigned int l = length;
-	const uint8_t* data = ptr;
+	unsigned int i = atomic_load_explicit(&r->inpos, memory_order_relaxed);
+	unsigned int o = atomic_load_explicit(&r->outpos, memory_order_acquire);
+	unsigned int n = MIN(length, r->bufferlen - (i - o));
+	unsigned int pos = i & r->mask;
+	unsigned int first = MIN(n, contiguousFrom(r, pos));
 	
-	while ( c-- > 0 && l > 0 )
-	{
-		unsigned int n = MIN(l, RingBuffer_getInputAvailableSize(r));
-		memcpy(RingBuffer_getInputPointer(r), data, n);
-		RingBuffer_moveInputPointer(r, n);
-		data += n;
-		l -= n;
-	}
+	memcpy(r->buffer + pos, ptr, first);
+	
+	if ( n > first )
+		memcpy(r->buffer, (const uint8_t*)ptr + first, n - first);
 	
-	return length - l;
+	atomic_store_explicit(&r->inpos, i + n, memory_order_release);
+	return n;
 }
 
+// consumer side
+
 unsigned int RingBuffer_getBytesAvailable(RingBuffer* r)
 {
-	// save r->inpos in case another thread changes it
-	unsigned int i = r->inpos;
-	unsigned int o = r->outpos;
+	unsigned int i = atomic_load_explicit(&r->inpos, memory_order_acquire);
+	unsigned int o = atomic_load_explicit(&r->outpos, memory_order_acquire);
 	
-	if ( o <= i )
-		return i - o;
-	else
-		return r->bufferlen - o + i;
+	return i - o;
 }
 
 unsigned int RingBuffer_getOutputAvailableSize(RingBuffer* r)
 {
-	unsigned int i = r->inpos;
+	unsigned int i = atomic_load_explicit(&r->inpos, memory_order_acquire);
+	unsigned int o = atomic_load_explicit(&r->outpos, memory_order_relaxed);
 	
-	if ( r->outpos <= i )
-		return i - r->outpos;
-	else
-		return r->bufferlen - r->outpos;
+	return MIN(i - o, contiguousFrom(r, o));
 }
 
 void* RingBuffer_getOutputPointer(RingBuffer* r)
 {
-	return (uint8_t*)r->buffer + r->outpos;
+	return r->buffer + (atomic_load_explicit(&r->outpos, memory_order_relaxed) & r->mask);
 }
 
 void RingBuffer_moveOutputPointer(RingBuffer* r, unsigned int bytes)
 {
-	r->outpos = (r->outpos + bytes) % r->bufferlen;
-	
-	/* no! we can't touch inpos!
-	if ( r->outpos == r->inpos )
-	{
-		r->outpos = r->inpos = 0;
-		return;
-	}
-	*/
-	// wrap inpos around if it's waiting for outpos to get off the 0 position
-	if ( r->inpos == r->bufferlen && r->outpos != 0 )
-		r->inpos = 0;
-	
-	if ( r->outpos == r->bufferlen && r->inpos != 0 )
-	{
-//		r->fileOffset += r->bufferlen;
-		r->outpos = 0;
-	}
+	unsigned int o = atomic_load_explicit(&r->outpos, memory_order_relaxed);
+	atomic_store_explicit(&r->outpos, o + bytes, memory_order_release);
 }
 
-unsigned int RingBuffer_readData(RingBuffer* r, void* ptr, unsigned int length)
+unsigned int RingBuffer_peekData(RingBuffer* r, void* ptr, unsigned int offset, unsigned int length)
 {
-//	printf("RingBuffer_readData(%p, %p, %i)\n", r, ptr, length);
+	unsigned int i = atomic_load_explicit(&r->inpos, memory_order_acquire);
+	unsigned int o = atomic_load_explicit(&r->outpos, memory_order_relaxed);
 	
-	int c = (r->outpos > r->inpos) ? 2 : 1;
-	unsigned int l = length;
-	uint8_t* data = ptr;
+	if ( offset >= i - o )
+		return 0;
 	
-	while ( c-- > 0 && l > 0 )
-	{
-		unsigned int n = MIN(l, RingBuffer_getOutputAvailableSize(r));
-		memcpy(data, RingBuffer_getOutputPointer(r), n);
-		RingBuffer_moveOutputPointer(r, n);
-		data += n;
-		l -= n;
-	}
+	unsigned int n = MIN(length, i - o - offset);
+	unsigned int pos = (o + offset) & r->mask;
+	unsigned int first = MIN(n, contiguousFrom(r, pos));
+	
+	memcpy(ptr, r->buffer + pos, first);
+	
+	if ( n > first )
+		memcpy((uint8_t*)ptr + first, r->buffer, n - first);
 	
-	return length - l;
+	return n;
+}
+
+unsigned int RingBuffer_readData(RingBuffer* r, void* ptr, unsigned int length)
+{
+	unsigned int n = RingBuffer_peekData(r, ptr, 0, length);
+	RingBuffer_moveOutputPointer(r, n);
+	return n;
 }
@@ -11,23 +11,40 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+
+// Single producer, single consumer: one thread adds data and moves the input pointer, one
+// thread reads data and moves the output pointer, and neither needs a lock.
+
+#define RINGBUFFER_CACHE_LINE 64
 
 typedef struct
 {
-	void* buffer;
-	unsigned int bufferlen;
+	uint8_t* buffer;
+	unsigned int bufferlen; // always a power of two
+	unsigned int mask; // bufferlen - 1
 	unsigned int datasize; // number of bytes in a frame
-	unsigned int inpos; // offset of the input/read pointer (this moves when we read data from disk)
-	unsigned int outpos; // offset of the output pointer (this moves when we push audio to output)
+	bool mirrored; // buffer is mapped twice back to back, so data never wraps
+	
+	// free-running byte counts, inpos - outpos is the amount of data in the buffer. They're on
+	// separate cache lines so the producer and consumer threads don't fight over one.
+	_Alignas(RINGBUFFER_CACHE_LINE) _Atomic unsigned int inpos; // moves when the producer adds data
+	_Alignas(RINGBUFFER_CACHE_LINE) _Atomic unsigned int outpos; // moves when the consumer reads data
 } RingBuffer;
 
 void RingBuffer_init(RingBuffer* r);
 void RingBuffer_deinit(RingBuffer* r);
 
+// bytes is rounded up to a power of two
 bool RingBuffer_setSize(RingBuffer* r, unsigned int bytes, unsigned int datasize);
+
+// Same, but maps the same pages twice in a row so every read and write region is contiguous:
+// getOutputAvailableSize() == getBytesAvailable() and getInputAvailableSize() == getFreeSpace().
+// Falls back to setSize() where that isn't possible.
+bool RingBuffer_setSizeMirrored(RingBuffer* r, unsigned int bytes, unsigned int datasize);
 unsigned int RingBuffer_getSize(RingBuffer* r);
 
-// clear inpos, outpos, and fileOffset
+// empties the buffer. Not thread safe: neither side can be using it at the time.
 void RingBuffer_reset(RingBuffer* r);
 
 unsigned int RingBuffer_getFreeSpace(RingBuffer* r);
@@ -39,6 +56,9 @@ unsigned int RingBuffer_addData(RingBuffer* r, const void* data, unsigned int le
 // returns number of bytes actually copied, if bytes > available data
 unsigned int RingBuffer_readData(RingBuffer* r, void* data, unsigned int bytes);
 
+// like readData, but starts offset bytes past the output pointer and doesn't move it
+unsigned int RingBuffer_peekData(RingBuffer* r, void* data, unsigned int offset, unsigned int bytes);
+
 // direct access to buffer data:
 unsigned int RingBuffer_getInputAvailableSize(RingBuffer* r); // contiguous space
 void* RingBuffer_getInputPointer(RingBuffer* r);
@@ -12,6 +12,7 @@
 #include <termios.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
 
 #if TARGET_RPI
 #include <libudev.h>
@@ -174,6 +175,18 @@ static char* FindPlaydateSerialPort()
 }
 #endif
 
+#if !TARGET_RPI && !TARGET_MACOS
+static char* FindPlaydateSerialPort()
+{
+	return NULL;
+}
+#endif
+
+char* ser_findDevice()
+{
+	return FindPlaydateSerialPort();
+}
+
 bool ser_open()
 {
 	char* dev = FindPlaydateSerialPort();
@@ -181,6 +194,13 @@ bool ser_open()
 	if ( dev == NULL )
 		return false;
 	
+	bool ok = ser_openDevice(dev);
+	free(dev);
+	return ok;
+}
+
+bool ser_openDevice(const char* dev)
+{
 	LOG("PlaydateSerialOpen (%s)\n", dev);
 
 	struct flock lock, ourlock;
@@ -188,28 +208,25 @@ bool ser_open()
 	if ( g_fd != -1 )
 	{
 		LOG("Serial port was already open (%d)\n", g_fd);
-		free(dev);
 		return true;
 	}
 		
 	if ( access(dev, F_OK) == -1 )
 	{
 		LOG("Device %s does not exist\n", dev);
-		free(dev);
 		return false;
 	}
 
-	g_fd = open(dev, O_RDWR | /*O_NONBLOCK |*/ O_NOCTTY | O_SYNC | O_CLOEXEC );
+	// non-blocking so the outbound queue never stalls the main loop, reads and blocking
+	// writes wait with poll() instead
+	g_fd = open(dev, O_RDWR | O_NONBLOCK | O_NOCTTY | O_SYNC | O_CLOEXEC );
 
 	if ( g_fd == -1 )
 	{
 		LOG("Couldn't open %s (%d)\n", dev, errno);
-		free(dev);
 		return false;
 	}
 
-	free(dev);
-
 	//lock port
 	lock.l_type    = F_WRLCK;
 	lock.l_start   = 0;
@@ -277,6 +294,11 @@ bool ser_isOpen()
 	return g_fd != -1;
 }
 
+int ser_getFd()
+{
+	return g_fd;
+}
+
 void ser_close()
 {
 #if DEBUG
@@ -340,7 +362,9 @@ ssize_t ser_write(const char* buffer, size_t size)
 			}
 			else if ( len_written < 0 && errno == EAGAIN )
 			{
-				//try again
+				// wait for room and try again
+				struct pollfd pfd = { .fd = g_fd, .events = POLLOUT };
+				poll(&pfd, 1, 100);
 				len_written = 0;
 			}
 		}
@@ -372,7 +396,9 @@ ssize_t ser_writeNonblocking(const char* buffer, size_t size)
 	{
 		ssize_t n = write(g_fd, buffer, size);
 		
-		if ( n == -1 )
+		if ( n == -1 && errno == EAGAIN )
+			return 0;
+		else if ( n == -1 )
 			ser_close();
 		else
 			return n;
@@ -386,6 +412,12 @@ ssize_t ser_read(uint8_t* buffer, size_t size)
 	if ( !ser_isOpen() )
 		return -1;
 	
+	// same as the old VTIME=1 blocking read: return after 100ms if nothing shows up
+	struct pollfd pfd = { .fd = g_fd, .events = POLLIN };
+	
+	if ( poll(&pfd, 1, 100) == 0 )
+		return 0;
+	
 	ssize_t n = read(g_fd, buffer, size);
 	
 	if ( n == -1 )
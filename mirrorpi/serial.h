@@ -13,14 +13,20 @@
 #include <stdio.h>
 #include <string.h>
 
+// finds the Playdate's tty (caller frees), or NULL if it isn't plugged in
+char* ser_findDevice();
+
 bool ser_open();
+bool ser_openDevice(const char* dev);
 bool ser_isOpen();
 void ser_close();
+int ser_getFd();
 
 ssize_t ser_write(const char* buffer, size_t size);
 #define ser_writestr(s) ser_write(s, strlen(s));
 ssize_t ser_writeLine(const char* cmd);
 
+// returns 0 if the port can't take any data right now, -1 (and closes the port) on error
 ssize_t ser_writeNonblocking(const char* buffer, size_t size);
 ssize_t ser_read(uint8_t* buffer, size_t size);
 void ser_flush(void);
@@ -1,11 +1,15 @@
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <unistd.h>
 #include "stream.h"
 #include "serial.h"
 #include "frame.h"
 #include "audio.h"
 #include "ringbuffer.h"
+#include "outqueue.h"
+#include "inputtest.h"
+#include "events.h"
 
 #define LOG printf
 //#define LOG(...)
@@ -24,12 +28,12 @@ enum StreamProtocolState {
 	kStreamParsingFirstHeader,
 	kStreamParsingHeader,
 	kStreamParsingPayload,
-	kStreamParsingPoke
+	kStreamParsingPoke,
+	kStreamResyncing
 } state;
 
 #define MAX_PAYLOAD_SIZE (sizeof(MessageFrameData) + FRAME_SIZE_BYTES)
-uint8_t payload[MAX_PAYLOAD_SIZE];
-int payloadBytesRead = 0;
+uint8_t payload[MAX_PAYLOAD_SIZE]; // staging for messages that wrap around the ring
 
 enum StreamAudioConfig audio_config = kAudioStereo16;
 enum StreamAudioMute audio_mute = kAudioMuteOff;
@@ -53,7 +57,9 @@ void handleStreamMessage(MessageHeader *hdr);
 bool stream_init()
 {
 	RingBuffer_init(&serialbuf);
-	RingBuffer_setSize(&serialbuf, BUFFER_SIZE, 1);
+	
+	// mirrored, so a message is never split by the end of the buffer
+	RingBuffer_setSizeMirrored(&serialbuf, BUFFER_SIZE, 1);
 	
 	//usleep(10000);
 	
@@ -74,7 +80,7 @@ void sendStreamOption(const char* opt)
 {
 	char buf[32];
 	snprintf(buf, 32, "stream %s\r\n", opt);
-	ser_writeNonblocking(buf, strlen(buf));
+	outqueue_push(buf, kOutQueueLow);
 }
 
 void disableStream()
@@ -108,6 +114,9 @@ void sendStreamEnable()
 
 void reconnect()
 {
+	// the writes below go straight to the port, they can't land in the middle of a
+	// half-written batch, and the flush throws away whatever of it is still unsent
+	outqueue_reset();
 	disableStream();
 	LOG("Flushing connection\n");
 	usleep(10000);
@@ -125,7 +134,7 @@ void sendCrankChange(double angle_change);
 void stream_poke()
 {
 	// let device know we're still here
-	ser_writeNonblocking(STREAM_POKE, strlen(STREAM_POKE));
+	outqueue_push(STREAM_POKE, kOutQueueLow);
 }
 
 const char* getOptionString(enum StreamAudioConfig cfg)
@@ -158,7 +167,7 @@ void setAudioConfiguration(enum StreamAudioConfig cfg)
 void setMuteValue(enum StreamAudioMute value)
 {
 	audio_mute = value;
-	ser_writestr(value == kAudioMuteOn ? "mute on\r\n" : "mute off\r\n");
+	outqueue_push(value == kAudioMuteOn ? "mute on\r\n" : "mute off\r\n", kOutQueueLow);
 }
 
 uint32_t swap_bits(uint8_t n)
@@ -205,7 +214,7 @@ bool prv_is_valid_header(MessageHeader hdr)
 			else if ( hdr.unused == APPLICATION_COMMAND_4BIT_PALETTE )
 				return (sz == sizeof(Message4bitPalette));
 			else
-				return true;
+				return (sz <= MAX_PAYLOAD_SIZE);
 		}
 		case 's':
 			return (sz == 25970); // "stream poke"
@@ -257,15 +266,14 @@ void streamStarted()
 	setMuteValue(audio_mute);
 }
 
-static void handleStreamPayload();
+static void handleStreamPayload(const MessageHeader* hdr, const uint8_t* data);
 
 MessageHeader header;
-int headerBytesRead = 0;
 int pokeBytesRead = 0;
 
 #define MAX(a,b) (((a)>(b))?(a):(b))
 
-void stream_addData(uint8_t* buf, unsigned int len)
+void stream_addData(const uint8_t* buf, unsigned int len)
 {
 	for ( ;; )
 	{
@@ -283,16 +291,81 @@ void stream_addData(uint8_t* buf, unsigned int len)
 		
 		buf += n;
 		printf("serial ringbuffer full\n");
+		
+		// the caller only signals once we return, and the main loop won't drain the ring until it hears
+		events_signal(kEventSerialData);
 		usleep(1000);
 	}
 }
 
-bool stream_processbuf(uint8_t* buf, unsigned int len)
+// When a header doesn't validate we don't tear down the session, we scan forward through the
+// buffered bytes for the next position that looks like a header: a known opcode with a length
+// that makes sense for it, and (if resyncConfirm is set and enough data has arrived) another
+// valid header right after its payload.
+
+bool resyncConfirm = true;
+static StreamStats stats;
+static unsigned int resyncBytesSkipped = 0;
+static enum StreamProtocolState resyncResumeState = kStreamParsingHeader;
+
+static void beginResync()
+{
+	resyncResumeState = (state == kStreamParsingFirstHeader) ? kStreamParsingFirstHeader : kStreamParsingHeader;
+	resyncBytesSkipped = 0;
+	++stats.resyncs;
+	state = kStreamResyncing;
+}
+
+static bool isHeaderAt(unsigned int offset, MessageHeader* hdr)
+{
+	RingBuffer_peekData(&serialbuf, hdr, offset, sizeof(MessageHeader));
+	return strncmp((char*)hdr, "stre", 4) == 0 || prv_is_valid_header(*hdr);
+}
+
+// returns true if a header starts *skip bytes in, false if we need more data first (in which case
+// it's safe to drop *skip bytes)
+static bool findNextHeader(unsigned int avail, unsigned int* skip)
 {
-	uint8_t* end = buf + len;
+	unsigned int offset;
+	
+	for ( offset = 0; offset + sizeof(MessageHeader) <= avail; ++offset )
+	{
+		MessageHeader hdr;
+		
+		if ( !isHeaderAt(offset, &hdr) )
+			continue;
+		
+		if ( !resyncConfirm || strncmp((char*)&hdr, "stre", 4) == 0 )
+			break;
+		
+		unsigned int next = offset + sizeof(MessageHeader) + hdr.payload_length;
+		
+		// wait for the following header before committing to this one
+		if ( next + sizeof(MessageHeader) > avail )
+		{
+			*skip = offset;
+			return false;
+		}
+		
+		if ( isHeaderAt(next, &hdr) )
+			break;
+	}
 	
-	while ( buf < end )
+	*skip = offset;
+	return offset + sizeof(MessageHeader) <= avail;
+}
+
+// Parses every complete message sitting in serialbuf. When a message is contiguous in the
+// ring we hand handleStreamPayload() a pointer straight into the ring memory; only a message
+// that straddles the end of the buffer gets copied out, in bulk, to the payload staging area.
+// With the mirrored buffer that never happens.
+
+static bool stream_processbuf()
+{
+	for ( ;; )
 	{
+		unsigned int avail = RingBuffer_getBytesAvailable(&serialbuf);
+		
 		switch ( state ) 
 		{
 			case kStreamDisabled:
@@ -300,14 +373,23 @@ bool stream_processbuf(uint8_t* buf, unsigned int len)
 	
 			case kStreamEnabling:
 			{
-				while ( buf < end && expectedBytesRead < strlen(STREAM_ENABLE) )
+				unsigned int len = RingBuffer_getOutputAvailableSize(&serialbuf);
+				const uint8_t* buf = RingBuffer_getOutputPointer(&serialbuf);
+				unsigned int n = 0;
+				
+				if ( len == 0 )
+					return true;
+				
+				while ( n < len && expectedBytesRead < strlen(STREAM_ENABLE) )
 				{
-					if ( *buf++ == STREAM_ENABLE[expectedBytesRead] )
+					if ( buf[n++] == STREAM_ENABLE[expectedBytesRead] )
 						++expectedBytesRead;
 					else
 						expectedBytesRead = 0;
 				}
 				
+				RingBuffer_moveOutputPointer(&serialbuf, n);
+				
 				if ( expectedBytesRead == strlen(STREAM_ENABLE) )
 				{
 					printf("stream enable received\n");
@@ -320,30 +402,21 @@ bool stream_processbuf(uint8_t* buf, unsigned int len)
 			case kStreamStreamStarting:
 			{
 				// XXX - first opcode received is 0x0d = \n :(
-				
-				// skip errant \r and \n
-				//if ( *buf != '\r' && *buf != '\n' )
-				//{
-					headerBytesRead = 0;
-					state = kStreamParsingFirstHeader;
-				//}
-				//else
-				//	++buf;
-					
+				state = kStreamParsingFirstHeader;
 				break;
 			}
 			case kStreamParsingFirstHeader:
 			case kStreamParsingHeader:
 			{
-				while ( buf < end && headerBytesRead < sizeof(MessageHeader) )
-					((uint8_t*)&header)[headerBytesRead++] = *buf++;
-				
-				if ( headerBytesRead < sizeof(MessageHeader) )
+				if ( avail < sizeof(MessageHeader) )
 					return true;
 				
+				RingBuffer_peekData(&serialbuf, &header, 0, sizeof(MessageHeader));
+				
 				if ( strncmp((char*)&header, "stre", 4) == 0 )
 				{
 					printf("read \"stre\", scanning for \"stream poke\"\n");
+					RingBuffer_moveOutputPointer(&serialbuf, sizeof(MessageHeader));
 					pokeBytesRead = 4;
 					state = kStreamParsingPoke;
 					continue;
@@ -351,75 +424,109 @@ bool stream_processbuf(uint8_t* buf, unsigned int len)
 
 				if ( !prv_is_valid_header(header) )
 				{
-					LOG("Invalid header opcode %d length %d, reconnecting\n", header.opcode, header.payload_length);
-//					exit(0);
-					reconnect();
-					return false;
+					LOG("Invalid header opcode %d length %d, resyncing\n", header.opcode, header.payload_length);
+					beginResync();
+					
+					// the bad header starts at the output pointer, so it can't be the next one
+					RingBuffer_moveOutputPointer(&serialbuf, 1);
+					++resyncBytesSkipped;
+					++stats.bytesSkipped;
+					continue;
 				}
 			
+				RingBuffer_moveOutputPointer(&serialbuf, sizeof(MessageHeader));
+
 				//LOG("Received opcode %u sz %u\n", header.opcode, header.payload_length);
 
 				if ( state == kStreamParsingFirstHeader )
 					streamStarted();
 
-				payloadBytesRead = 0;
 				state = kStreamParsingPayload;
-				
 				break;
 			}
 			case kStreamParsingPayload:
 			{
-				const size_t payload_size = header.payload_length;
+				const unsigned int payload_size = header.payload_length;
 				
-				while ( buf < end && payloadBytesRead < payload_size )
-					payload[payloadBytesRead++] = *buf++;
-
-				if ( payload_size > 0 && payloadBytesRead < payload_size )
+				if ( avail < payload_size )
 					return true;
 				
-				//LOG("Finished parsing message\n");
-				handleStreamPayload();
+				if ( RingBuffer_getOutputAvailableSize(&serialbuf) >= payload_size )
+				{
+					// whole message is contiguous, parse it in place
+					handleStreamPayload(&header, RingBuffer_getOutputPointer(&serialbuf));
+					RingBuffer_moveOutputPointer(&serialbuf, payload_size);
+				}
+				else
+				{
+					// message wraps around the end of the ring (only if serialbuf isn't mirrored)
+					RingBuffer_readData(&serialbuf, payload, payload_size);
+					handleStreamPayload(&header, payload);
+				}
 				
-				headerBytesRead = 0;
 				state = kStreamParsingHeader;
 				break;
 			}
 			case kStreamParsingPoke:
 			{
-				int len = strlen(STREAM_POKE);
+				unsigned int len = strlen(STREAM_POKE);
+				unsigned int n = RingBuffer_getOutputAvailableSize(&serialbuf);
+				const uint8_t* buf = RingBuffer_getOutputPointer(&serialbuf);
+				unsigned int i = 0;
 				
-//				while ( buf < end && pokeBytesRead < len && *buf == STREAM_POKE[pokeBytesRead] )
-//					++pokeBytesRead;
-
-				while ( buf < end )
+				while ( i < n && pokeBytesRead < len )
 				{
-					if ( pokeBytesRead < len )
+					printf("looking for char %i %c (%02x), got %c (%02x)\n", pokeBytesRead, STREAM_POKE[pokeBytesRead], STREAM_POKE[pokeBytesRead], buf[i], buf[i]);
+					
+					if ( buf[i] == STREAM_POKE[pokeBytesRead] || buf[i] == STREAM_ENABLE[pokeBytesRead] )
 					{
-						printf("looking for char %i %c (%02x), got %c (%02x)\n", pokeBytesRead, STREAM_POKE[pokeBytesRead], STREAM_POKE[pokeBytesRead], *buf, *buf);
-						
-						if ( *buf == STREAM_POKE[pokeBytesRead] || *buf == STREAM_ENABLE[pokeBytesRead] )
-						{
-							++pokeBytesRead;
-							++buf;
-						}
-						else
-							break;
+						++pokeBytesRead;
+						++i;
 					}
 					else
 						break;
 				}
 				
+				RingBuffer_moveOutputPointer(&serialbuf, i);
+				
 				if ( pokeBytesRead == len )
 				{
 					printf("found \"stream poke\", back to payloads\n");
-					headerBytesRead = 0;
 					state = kStreamParsingHeader;
 				}
-				else if ( buf < end )
+				else if ( i < n )
 				{
-					printf("failed reading stream poke\n");
-					exit(0);
+					printf("failed reading stream poke, resyncing\n");
+					beginResync();
 				}
+				else
+					return true;
+				
+				break;
+			}
+			case kStreamResyncing:
+			{
+				unsigned int skip = 0;
+				bool found = findNextHeader(avail, &skip);
+				
+				RingBuffer_moveOutputPointer(&serialbuf, skip);
+				resyncBytesSkipped += skip;
+				stats.bytesSkipped += skip;
+				
+				if ( found )
+				{
+					printf("resynced after skipping %u bytes\n", resyncBytesSkipped);
+					state = resyncResumeState;
+				}
+				else if ( resyncBytesSkipped > BUFFER_SIZE )
+				{
+					// a whole buffer of garbage, the session really is broken
+					LOG("No valid header found in %u bytes, reconnecting\n", resyncBytesSkipped);
+					reconnect();
+					return false;
+				}
+				else
+					return true;
 				
 				break;
 			}
@@ -431,45 +538,41 @@ bool stream_processbuf(uint8_t* buf, unsigned int len)
 
 bool stream_process()
 {
-	unsigned int n;
-	
-	while ( (n = RingBuffer_getOutputAvailableSize(&serialbuf)) > 0 )
-	{
-		if ( !stream_processbuf(RingBuffer_getOutputPointer(&serialbuf), n) )
-			return false;
-		
-		RingBuffer_moveOutputPointer(&serialbuf, n);
-	}
-	
-	return true;
+	return stream_processbuf();
 }
 
-static void handleStreamPayload()
+// Payloads may point directly into serialbuf, so there's no alignment guarantee: multi-byte
+// fields are read with memcpy instead of through the struct pointer.
+
+static void handleStreamPayload(const MessageHeader* hdr, const uint8_t* data)
 {
-	if ( header.opcode == OPCODE_FRAME_BEGIN_DEPRECATED )
+	if ( hdr->opcode == OPCODE_FRAME_BEGIN_DEPRECATED )
 	{
 		int64_t ts_ms = 0; //wxGetUTCTimeMillis().GetValue() - stream_start_ms;
 		frame_begin((uint32_t)ts_ms);
 	}
-	else if ( header.opcode == OPCODE_FRAME_BEGIN )
+	else if ( hdr->opcode == OPCODE_FRAME_BEGIN )
 	{
-		MessageFrameBegin* rb = (MessageFrameBegin*)&payload[0];
-		frame_begin(rb->timestamp_ms);
+		MessageFrameBegin fb;
+		memcpy(&fb, data, sizeof(fb));
+		frame_begin(fb.timestamp_ms);
 	}
-	else if ( header.opcode == OPCODE_FRAME_ROW )
+	else if ( hdr->opcode == OPCODE_FRAME_ROW )
 	{
-		MessageRowData* rd = (MessageRowData*)&payload[0];
+		const MessageRowData* rd = (const MessageRowData*)data;
 		frame_setRow(swap_bits(rd->rowNum), rd->data);
 	}
-	else if ( header.opcode == OPCODE_FRAME_END )
+	else if ( hdr->opcode == OPCODE_FRAME_END )
 	{
 		frame_end();
 	}
-	else if ( header.opcode == OPCODE_FULL_FRAME )
+	else if ( hdr->opcode == OPCODE_FULL_FRAME )
 	{
-		MessageFrameData* fd = (MessageFrameData*)&payload[0];
+		const MessageFrameData* fd = (const MessageFrameData*)data;
+		uint32_t timestamp_ms;
+		memcpy(&timestamp_ms, data + offsetof(MessageFrameData, timestamp_ms), sizeof(timestamp_ms));
 		
-		frame_begin(fd->timestamp_ms);
+		frame_begin(timestamp_ms);
 		
 		for ( unsigned int i = 0, row = 0; i < FRAME_HEIGHT; ++i )
 		{
@@ -479,49 +582,58 @@ static void handleStreamPayload()
 		
 		frame_end();
 	}
-	else if ( header.opcode == OPCODE_AUDIO_CHANGE )
+	else if ( hdr->opcode == OPCODE_AUDIO_CHANGE )
 	{
-		MessageAudioChange* ac = (MessageAudioChange*)&payload[0];
-		unsigned int num_channels = (ac->flags & STREAM_AUDIO_FLAG_STEREO) ? 2 : 1;
+		MessageAudioChange ac;
+		memcpy(&ac, data, sizeof(ac));
+		unsigned int num_channels = (ac.flags & STREAM_AUDIO_FLAG_STEREO) ? 2 : 1;
 		audio_setFormat(num_channels);
 	}
-	else if ( header.opcode == OPCODE_AUDIO_FRAME )
+	else if ( hdr->opcode == OPCODE_AUDIO_FRAME )
 	{
 		if ( audio_config != kAudioDisabled )
 		{
-			MessageAudioFrame* af = (MessageAudioFrame*)&payload[0];
-			audio_addData(af->data, header.payload_length);
+			const MessageAudioFrame* af = (const MessageAudioFrame*)data;
+			audio_addData(af->data, hdr->payload_length);
 		}
 	}
-	else if ( header.opcode == OPCODE_AUDIO_OFFSET )
+	else if ( hdr->opcode == OPCODE_AUDIO_OFFSET )
 	{
 		if ( audio_config != kAudioDisabled )
 		{
-			MessageAudioOffset* ao = (MessageAudioOffset*)&payload[0];
-			audio_addSilence(ao->offset_samples);
+			MessageAudioOffset ao;
+			memcpy(&ao, data, sizeof(ao));
+			audio_addSilence(ao.offset_samples);
 		}
 	}
-	else if ( header.opcode == OPCODE_DEVICE_STATE )
+	else if ( hdr->opcode == OPCODE_DEVICE_STATE )
 	{
-		MessageDeviceState* state = (MessageDeviceState*)&payload[0];
+		MessageDeviceState state;
+		memcpy(&state, data, sizeof(state));
 		static int lastdropped = -1;
-		int dropped = state->unused;
+		int dropped = state.unused;
 		if ( dropped != lastdropped && lastdropped != -1 )
 			printf("%i messages dropped\n", dropped>lastdropped ? dropped-lastdropped : dropped+65536-lastdropped);
 		lastdropped = dropped;
+		inputtest_deviceState(state.buttonMask);
 	}
-	else if ( header.opcode == OPCODE_APPLICATION )
+	else if ( hdr->opcode == OPCODE_APPLICATION )
 	{
 		// mode/palette change message
-		if ( header.unused == APPLICATION_COMMAND_RESET )
+		if ( hdr->unused == APPLICATION_COMMAND_RESET )
 			frame_reset();
-		else if ( header.unused == APPLICATION_COMMAND_1BIT_PALETTE )
-			frame_set1BitPalette((RGB*)payload);
-		else if ( header.unused == APPLICATION_COMMAND_4BIT_PALETTE )
-			frame_set4BitPalette((RGB*)payload);
+		else if ( hdr->unused == APPLICATION_COMMAND_1BIT_PALETTE )
+			frame_set1BitPalette((const RGB*)data);
+		else if ( hdr->unused == APPLICATION_COMMAND_4BIT_PALETTE )
+			frame_set4BitPalette((const RGB*)data);
 	}
 }
 
+void stream_getStats(StreamStats* out)
+{
+	*out = stats;
+}
+
 void stream_begin()
 {
 	ser_flush();
@@ -533,6 +645,7 @@ void stream_begin()
 void stream_reset()
 {
 	ser_flush();
+	outqueue_reset();
 	expectedBytesRead = 0;
 	state = kStreamDisabled;
 	RingBuffer_reset(&serialbuf);
@@ -545,7 +658,7 @@ void stream_sendButtonPress(int btn)
 	char buf[] = "btn +x\r\n";
 	buf[5] = keynames[btn];
 	printf("sending +%c\n", buf[5]);
-	ser_writeNonblocking(buf, strlen(buf));
+	outqueue_push(buf, kOutQueueHigh);
 }
 
 void stream_sendButtonRelease(int btn)
@@ -553,25 +666,22 @@ void stream_sendButtonRelease(int btn)
 	char buf[] = "btn -x\r\n";
 	buf[5] = keynames[btn];
 	printf("sending -%c\n", buf[5]);
-	ser_writeNonblocking(buf, strlen(buf));
+	outqueue_push(buf, kOutQueueHigh);
 }
 
 void stream_sendCrankChange(float angle_change)
 {
-	char buf[32];
-	snprintf(buf, 32, "changecrank %.1f\r\n", angle_change);
-	ser_writeNonblocking(buf, strlen(buf));
+	outqueue_pushCrankChange(angle_change);
 }
 
 void stream_sendAccelChange(double x, double y, double z)
 {
 	char buf[32];
 	snprintf(buf, 32, "accel %i %i %i\r\n", (int)(x*1000), (int)(y*1000), (int)(z*1000));
-	ser_writeNonblocking(buf, strlen(buf));
+	outqueue_push(buf, kOutQueueLow);
 }
 
 void stream_sendCrankDocked(bool docked)
 {
-	const char* msg = docked ? "dockcrank 1\r\n" : "dockcrank 0\r\n";
-	ser_writeNonblocking(msg, strlen(msg));
+	outqueue_push(docked ? "dockcrank 1\r\n" : "dockcrank 0\r\n", kOutQueueHigh);
 }
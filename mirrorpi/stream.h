@@ -101,12 +101,19 @@ enum StreamAudioMute
 	kAudioMuteOff
 };
 
+typedef struct
+{
+	unsigned int resyncs; // times we lost sync with the message stream
+	unsigned int bytesSkipped; // bytes thrown away while looking for the next header
+} StreamStats;
+
 bool stream_init();
 void stream_begin();
 void stream_poke();
-void stream_addData(uint8_t* buf, unsigned int len);
+void stream_addData(const uint8_t* buf, unsigned int len);
 bool stream_process();
 void stream_reset();
+void stream_getStats(StreamStats* stats);
 
 void stream_sendButtonPress(int btn);
 void stream_sendButtonRelease(int btn);